@@ -11,14 +11,50 @@
 #include <linux/slab.h>
 #include "fat.h"
 
-/* this must be > 0. */
-#define FAT_MAX_CACHE	8
+/*
+ * The LRU of an inode starts with FAT_MAX_CACHE entries (fat.h). Lookups
+ * which had to walk over several uncached runs while the LRU was full tell
+ * that it is too small for the fragments this inode is accessed at, so its
+ * capacity doubles, up to FAT_MAX_CACHE_LIMIT. Sequential access only ever
+ * walks into the next run and never grows it, and it can't grow beyond the
+ * number of runs it gets to see. The entries above FAT_MAX_CACHE of all the
+ * inodes are bounded by FAT_CACHE_BUDGET, and given back by the shrinker.
+ */
+#define FAT_MAX_CACHE_LIMIT	1024
+#define FAT_CACHE_BUDGET	(64 * 1024)
 
+/*
+ * fat_cache_lookup() doesn't take ->cache_lru_lock. The entries are freed
+ * after an RCU grace period, and the writers, which still serialize on
+ * ->cache_lru_lock, change them and the list inside ->cache_seq, so that
+ * a lookup which raced with one retries. A hit doesn't move the entry to
+ * the head of the LRU either, it only sets ->referenced if it isn't yet:
+ * fat_cache_victim() gives such entries a second chance before reusing
+ * them (CLOCK), so a hot file is looked up without any write.
+ */
 struct fat_cache {
 	struct list_head cache_list;
 	int nr_contig;	/* number of contiguous clusters */
 	int fcluster;	/* cluster number in the file. */
 	int dcluster;	/* cluster number on disk. */
+	int referenced;	/* hit since it was last aged */
+	struct rcu_head rcu;
+};
+
+/*
+ * With the "extentmap" option, the inode keeps all the runs of its cluster
+ * chain found so far in an rb-tree sorted by fcluster, instead of the LRU
+ * of the last FAT_MAX_CACHE ones. fat_get_cluster() records every run it
+ * walks through, so one walk maps the chain up to that point, and later
+ * lookups anywhere in it are O(log n). The tree is dropped together with
+ * the LRU by fat_cache_inval_inode().
+ */
+struct fat_extent {
+	struct rb_node rb_node;
+	int nr_contig;	/* number of contiguous clusters */
+	int fcluster;	/* cluster number in the file. */
+	int dcluster;	/* cluster number on disk. */
+	struct rcu_head rcu;
 };
 
 struct fat_cache_id {
@@ -30,10 +66,130 @@ struct fat_cache_id {
 
 static inline int fat_max_cache(struct inode *inode)
 {
-	return FAT_MAX_CACHE;
+	return MSDOS_I(inode)->max_caches;
 }
 
 static struct kmem_cache *fat_cache_cachep;
+static struct kmem_cache *fat_extent_cachep;
+
+/* Inodes with max_caches > FAT_MAX_CACHE, the least recently grown first */
+static LIST_HEAD(fat_cache_grown);
+static DEFINE_SPINLOCK(fat_cache_grown_lock);
+/* Sum of (max_caches - FAT_MAX_CACHE) */
+static atomic_long_t fat_cache_extra;
+
+static void fat_cache_free_rcu(struct rcu_head *head)
+{
+	struct fat_cache *cache = container_of(head, struct fat_cache, rcu);
+
+	INIT_LIST_HEAD(&cache->cache_list);
+	kmem_cache_free(fat_cache_cachep, cache);
+}
+
+static void fat_extent_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(fat_extent_cachep,
+			container_of(head, struct fat_extent, rcu));
+}
+
+/* Gives the LRU its initial capacity back. Needs ->cache_lru_lock. */
+static unsigned long __fat_cache_shrink(struct msdos_inode_info *i)
+{
+	struct fat_cache *cache;
+	unsigned long freed = 0;
+
+	while (i->nr_caches > FAT_MAX_CACHE && !list_empty(&i->cache_lru)) {
+		cache = list_last_entry(&i->cache_lru, struct fat_cache,
+					cache_list);
+		write_seqcount_begin(&i->cache_seq);
+		list_del_rcu(&cache->cache_list);
+		write_seqcount_end(&i->cache_seq);
+		i->nr_caches--;
+		call_rcu(&cache->rcu, fat_cache_free_rcu);
+		freed++;
+	}
+	atomic_long_sub(i->max_caches - FAT_MAX_CACHE, &fat_cache_extra);
+	i->max_caches = FAT_MAX_CACHE;
+	i->nr_misses = 0;
+	return freed;
+}
+
+/* The cache entries above FAT_MAX_CACHE, which the scan can free */
+static unsigned long fat_cache_shrink_count(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	struct msdos_inode_info *i;
+	unsigned long count = 0;
+	int nr;
+
+	spin_lock(&fat_cache_grown_lock);
+	list_for_each_entry(i, &fat_cache_grown, cache_grown) {
+		nr = READ_ONCE(i->nr_caches);
+		if (nr > FAT_MAX_CACHE)
+			count += nr - FAT_MAX_CACHE;
+	}
+	spin_unlock(&fat_cache_grown_lock);
+	return count;
+}
+
+static unsigned long fat_cache_shrink_scan(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	struct msdos_inode_info *i;
+	unsigned long freed = 0;
+
+	spin_lock(&fat_cache_grown_lock);
+	while (freed < sc->nr_to_scan && !list_empty(&fat_cache_grown)) {
+		i = list_first_entry(&fat_cache_grown, struct msdos_inode_info,
+				     cache_grown);
+		/* The lock order is ->cache_lru_lock, fat_cache_grown_lock */
+		if (!spin_trylock(&i->cache_lru_lock)) {
+			list_move_tail(&i->cache_grown, &fat_cache_grown);
+			break;
+		}
+		list_del_init(&i->cache_grown);
+		freed += __fat_cache_shrink(i);
+		spin_unlock(&i->cache_lru_lock);
+	}
+	spin_unlock(&fat_cache_grown_lock);
+	return freed;
+}
+
+static struct shrinker fat_cache_shrinker = {
+	.count_objects	= fat_cache_shrink_count,
+	.scan_objects	= fat_cache_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
+/* Doubles the capacity of the LRU, if the budget allows */
+static void fat_cache_grow(struct inode *inode)
+{
+	struct msdos_inode_info *i = MSDOS_I(inode);
+	int grow = min(i->max_caches, FAT_MAX_CACHE_LIMIT - i->max_caches);
+
+	i->nr_misses = 0;
+	if (grow <= 0 ||
+	    atomic_long_read(&fat_cache_extra) + grow > FAT_CACHE_BUDGET)
+		return;
+	atomic_long_add(grow, &fat_cache_extra);
+	i->max_caches += grow;
+
+	spin_lock(&fat_cache_grown_lock);
+	list_move_tail(&i->cache_grown, &fat_cache_grown);
+	spin_unlock(&fat_cache_grown_lock);
+}
+
+/* A lookup walked over several runs while the LRU was full */
+static void fat_cache_miss(struct inode *inode)
+{
+	struct msdos_inode_info *i = MSDOS_I(inode);
+
+	spin_lock(&i->cache_lru_lock);
+	if (i->nr_caches >= fat_max_cache(inode) &&
+	    ++i->nr_misses >= fat_max_cache(inode))
+		fat_cache_grow(inode);
+	spin_unlock(&i->cache_lru_lock);
+}
 
 static void init_once(void *foo)
 {
@@ -50,14 +206,133 @@ int __init fat_cache_init(void)
 				init_once);
 	if (fat_cache_cachep == NULL)
 		return -ENOMEM;
+
+	fat_extent_cachep = kmem_cache_create("fat_extent",
+				sizeof(struct fat_extent),
+				0, SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD,
+				NULL);
+	if (fat_extent_cachep == NULL) {
+		kmem_cache_destroy(fat_cache_cachep);
+		return -ENOMEM;
+	}
+
+	if (register_shrinker(&fat_cache_shrinker)) {
+		kmem_cache_destroy(fat_extent_cachep);
+		kmem_cache_destroy(fat_cache_cachep);
+		return -ENOMEM;
+	}
 	return 0;
 }
 
 void fat_cache_destroy(void)
 {
+	unregister_shrinker(&fat_cache_shrinker);
+	/* Wait for fat_cache_free_rcu() and fat_extent_free_rcu() */
+	rcu_barrier();
+	kmem_cache_destroy(fat_extent_cachep);
 	kmem_cache_destroy(fat_cache_cachep);
 }
 
+static inline bool fat_use_extents(struct inode *inode)
+{
+	return MSDOS_SB(inode->i_sb)->options.extent_map;
+}
+
+/*
+ * Finds the extent of "fclus", or the nearest one before it. Without
+ * ->cache_lru_lock, a rotation can make it miss, never loop.
+ */
+static struct fat_extent *fat_extent_search(struct inode *inode, int fclus)
+{
+	struct rb_node *n = READ_ONCE(MSDOS_I(inode)->i_extents.rb_node);
+	struct fat_extent *ext, *best = NULL;
+
+	while (n) {
+		ext = rb_entry(n, struct fat_extent, rb_node);
+		if (fclus < ext->fcluster)
+			n = READ_ONCE(n->rb_left);
+		else {
+			best = ext;
+			if (fclus <= ext->fcluster + ext->nr_contig)
+				break;
+			n = READ_ONCE(n->rb_right);
+		}
+	}
+	return best;
+}
+
+/*
+ * Merges "new" into the extent before it if they are one run, else links
+ * "tmp" (if any) for it. Returns false if "new" needs "tmp".
+ */
+static bool __fat_extent_add(struct inode *inode, struct fat_cache_id *new,
+			     struct fat_extent *tmp)
+{
+	struct msdos_inode_info *i = MSDOS_I(inode);
+	struct rb_node **p = &i->i_extents.rb_node, *parent = NULL;
+	struct fat_extent *ext;
+
+	ext = fat_extent_search(inode, new->fcluster);
+	if (ext && new->fcluster <= ext->fcluster + ext->nr_contig + 1 &&
+	    new->dcluster - new->fcluster == ext->dcluster - ext->fcluster) {
+		ext->nr_contig = max(ext->nr_contig,
+				     new->fcluster - ext->fcluster
+				     + new->nr_contig);
+		return true;
+	}
+	if (!tmp)
+		return false;
+
+	while (*p) {
+		parent = *p;
+		ext = rb_entry(parent, struct fat_extent, rb_node);
+		if (new->fcluster < ext->fcluster)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	/* Lockless readers may walk to it as soon as it is linked */
+	tmp->fcluster = new->fcluster;
+	tmp->dcluster = new->dcluster;
+	tmp->nr_contig = new->nr_contig;
+	rb_link_node_rcu(&tmp->rb_node, parent, p);
+	rb_insert_color(&tmp->rb_node, &i->i_extents);
+	return true;
+}
+
+static void fat_extent_add(struct inode *inode, struct fat_cache_id *new)
+{
+	struct msdos_inode_info *i = MSDOS_I(inode);
+	struct fat_extent *tmp = NULL;
+
+	spin_lock(&i->cache_lru_lock);
+	if (new->id != FAT_CACHE_VALID && new->id != i->cache_valid_id)
+		goto out;	/* this cache was invalidated */
+	write_seqcount_begin(&i->cache_seq);
+	if (__fat_extent_add(inode, new, NULL)) {
+		write_seqcount_end(&i->cache_seq);
+		goto out;
+	}
+	write_seqcount_end(&i->cache_seq);
+	spin_unlock(&i->cache_lru_lock);
+
+	tmp = kmem_cache_alloc(fat_extent_cachep, GFP_NOFS);
+	if (!tmp)
+		return;
+
+	spin_lock(&i->cache_lru_lock);
+	if (new->id != FAT_CACHE_VALID && new->id != i->cache_valid_id)
+		goto out;
+	write_seqcount_begin(&i->cache_seq);
+	if (__fat_extent_add(inode, new, tmp))
+		tmp = NULL;
+	write_seqcount_end(&i->cache_seq);
+out:
+	spin_unlock(&i->cache_lru_lock);
+	if (tmp)
+		kmem_cache_free(fat_extent_cachep, tmp);
+}
+
 static inline struct fat_cache *fat_cache_alloc(struct inode *inode)
 {
 	return kmem_cache_alloc(fat_cache_cachep, GFP_NOFS);
@@ -72,44 +347,89 @@ static inline void fat_cache_free(struct fat_cache *cache)
 static inline void fat_cache_update_lru(struct inode *inode,
 					struct fat_cache *cache)
 {
-	if (MSDOS_I(inode)->cache_lru.next != &cache->cache_list)
-		list_move(&cache->cache_list, &MSDOS_I(inode)->cache_lru);
+	if (MSDOS_I(inode)->cache_lru.next != &cache->cache_list) {
+		list_del_rcu(&cache->cache_list);
+		list_add_rcu(&cache->cache_list, &MSDOS_I(inode)->cache_lru);
+	}
+}
+
+/*
+ * Picks the entry to reuse: the least recently added one, unless it was
+ * hit since it got there. Such ones are aged and go to the head again.
+ */
+static struct fat_cache *fat_cache_victim(struct inode *inode)
+{
+	struct list_head *lru = &MSDOS_I(inode)->cache_lru;
+	struct fat_cache *cache;
+
+	for (;;) {
+		cache = list_last_entry(lru, struct fat_cache, cache_list);
+		if (!READ_ONCE(cache->referenced))
+			return cache;
+		WRITE_ONCE(cache->referenced, 0);
+		list_del_rcu(&cache->cache_list);
+		list_add_rcu(&cache->cache_list, lru);
+	}
 }
 
 static int fat_cache_lookup(struct inode *inode, int fclus,
 			    struct fat_cache_id *cid,
 			    int *cached_fclus, int *cached_dclus)
 {
-	static struct fat_cache nohit = { .fcluster = 0, };
-
-	struct fat_cache *hit = &nohit, *p;
-	int offset = -1;
+	struct msdos_inode_info *i = MSDOS_I(inode);
+	struct fat_cache *hit, *p;
+	unsigned int seq;
+	int offset;
+
+	rcu_read_lock();
+	do {
+		seq = read_seqcount_begin(&i->cache_seq);
+		offset = -1;
+		hit = NULL;
+		if (fat_use_extents(inode)) {
+			struct fat_extent *ext = fat_extent_search(inode, fclus);
+
+			if (ext) {
+				offset = min(fclus - ext->fcluster,
+					     ext->nr_contig);
+				cid->id = i->cache_valid_id;
+				cid->nr_contig = ext->nr_contig;
+				cid->fcluster = ext->fcluster;
+				cid->dcluster = ext->dcluster;
+			}
+			continue;
+		}
 
-	spin_lock(&MSDOS_I(inode)->cache_lru_lock);
-	list_for_each_entry(p, &MSDOS_I(inode)->cache_lru, cache_list) {
-		/* Find the cache of "fclus" or nearest cache. */
-		if (p->fcluster <= fclus && hit->fcluster < p->fcluster) {
-			hit = p;
-			if ((hit->fcluster + hit->nr_contig) < fclus) {
-				offset = hit->nr_contig;
-			} else {
-				offset = fclus - hit->fcluster;
-				break;
+		list_for_each_entry_rcu(p, &i->cache_lru, cache_list) {
+			/* Find the cache of "fclus" or nearest cache. */
+			if (p->fcluster <= fclus &&
+			    (hit ? hit->fcluster : 0) < p->fcluster) {
+				hit = p;
+				if ((hit->fcluster + hit->nr_contig) < fclus) {
+					offset = hit->nr_contig;
+				} else {
+					offset = fclus - hit->fcluster;
+					break;
+				}
 			}
 		}
-	}
-	if (hit != &nohit) {
-		fat_cache_update_lru(inode, hit);
+		if (hit) {
+			cid->id = i->cache_valid_id;
+			cid->nr_contig = hit->nr_contig;
+			cid->fcluster = hit->fcluster;
+			cid->dcluster = hit->dcluster;
+		}
+	} while (read_seqcount_retry(&i->cache_seq, seq));
 
-		cid->id = MSDOS_I(inode)->cache_valid_id;
-		cid->nr_contig = hit->nr_contig;
-		cid->fcluster = hit->fcluster;
-		cid->dcluster = hit->dcluster;
+	/* Only the first hit since it was aged writes */
+	if (hit && !READ_ONCE(hit->referenced))
+		WRITE_ONCE(hit->referenced, 1);
+	rcu_read_unlock();
+
+	if (offset >= 0) {
 		*cached_fclus = cid->fcluster + offset;
 		*cached_dclus = cid->dcluster + offset;
 	}
-	spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
-
 	return offset;
 }
 
@@ -132,50 +452,72 @@ static struct fat_cache *fat_cache_merge(struct inode *inode,
 
 static void fat_cache_add(struct inode *inode, struct fat_cache_id *new)
 {
+	struct msdos_inode_info *i = MSDOS_I(inode);
 	struct fat_cache *cache, *tmp;
 
 	if (new->fcluster == -1) /* dummy cache */
 		return;
 
-	spin_lock(&MSDOS_I(inode)->cache_lru_lock);
-	if (new->id != FAT_CACHE_VALID &&
-	    new->id != MSDOS_I(inode)->cache_valid_id)
+	if (fat_use_extents(inode)) {
+		fat_extent_add(inode, new);
+		return;
+	}
+
+	spin_lock(&i->cache_lru_lock);
+	if (new->id != FAT_CACHE_VALID && new->id != i->cache_valid_id)
 		goto out;	/* this cache was invalidated */
 
+	write_seqcount_begin(&i->cache_seq);
 	cache = fat_cache_merge(inode, new);
 	if (cache == NULL) {
-		if (MSDOS_I(inode)->nr_caches < fat_max_cache(inode)) {
-			MSDOS_I(inode)->nr_caches++;
-			spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
+		if (i->nr_caches < fat_max_cache(inode)) {
+			i->nr_caches++;
+			write_seqcount_end(&i->cache_seq);
+			spin_unlock(&i->cache_lru_lock);
 
 			tmp = fat_cache_alloc(inode);
 			if (!tmp) {
-				spin_lock(&MSDOS_I(inode)->cache_lru_lock);
-				MSDOS_I(inode)->nr_caches--;
-				spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
+				spin_lock(&i->cache_lru_lock);
+				i->nr_caches--;
+				spin_unlock(&i->cache_lru_lock);
 				return;
 			}
 
-			spin_lock(&MSDOS_I(inode)->cache_lru_lock);
+			spin_lock(&i->cache_lru_lock);
+			write_seqcount_begin(&i->cache_seq);
 			cache = fat_cache_merge(inode, new);
 			if (cache != NULL) {
-				MSDOS_I(inode)->nr_caches--;
+				i->nr_caches--;
 				fat_cache_free(tmp);
 				goto out_update_lru;
 			}
-			cache = tmp;
-		} else {
-			struct list_head *p = MSDOS_I(inode)->cache_lru.prev;
-			cache = list_entry(p, struct fat_cache, cache_list);
+			tmp->fcluster = new->fcluster;
+			tmp->dcluster = new->dcluster;
+			tmp->nr_contig = new->nr_contig;
+			tmp->referenced = 0;
+			list_add_rcu(&tmp->cache_list, &i->cache_lru);
+			goto out_end;
 		}
+		cache = fat_cache_victim(inode);
 		cache->fcluster = new->fcluster;
 		cache->dcluster = new->dcluster;
 		cache->nr_contig = new->nr_contig;
+		cache->referenced = 0;
 	}
 out_update_lru:
 	fat_cache_update_lru(inode, cache);
+out_end:
+	write_seqcount_end(&i->cache_seq);
 out:
-	spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
+	spin_unlock(&i->cache_lru_lock);
+}
+
+/* Update. The copy of caches before this id is discarded. */
+static inline void __fat_cache_bump_id(struct msdos_inode_info *i)
+{
+	i->cache_valid_id++;
+	if (i->cache_valid_id == FAT_CACHE_VALID)
+		i->cache_valid_id++;
 }
 
 /*
@@ -186,18 +528,28 @@ static void __fat_cache_inval_inode(struct inode *inode)
 {
 	struct msdos_inode_info *i = MSDOS_I(inode);
 	struct fat_cache *cache;
+	struct fat_extent *ext, *n;
 
+	write_seqcount_begin(&i->cache_seq);
 	while (!list_empty(&i->cache_lru)) {
 		cache = list_entry(i->cache_lru.next,
 				   struct fat_cache, cache_list);
-		list_del_init(&cache->cache_list);
+		list_del_rcu(&cache->cache_list);
 		i->nr_caches--;
-		fat_cache_free(cache);
+		call_rcu(&cache->rcu, fat_cache_free_rcu);
 	}
-	/* Update. The copy of caches before this id is discarded. */
-	i->cache_valid_id++;
-	if (i->cache_valid_id == FAT_CACHE_VALID)
-		i->cache_valid_id++;
+	rbtree_postorder_for_each_entry_safe(ext, n, &i->i_extents, rb_node)
+		call_rcu(&ext->rcu, fat_extent_free_rcu);
+	WRITE_ONCE(i->i_extents.rb_node, NULL);
+	write_seqcount_end(&i->cache_seq);
+	if (i->max_caches > FAT_MAX_CACHE) {
+		__fat_cache_shrink(i);
+		spin_lock(&fat_cache_grown_lock);
+		list_del_init(&i->cache_grown);
+		spin_unlock(&fat_cache_grown_lock);
+	}
+	i->i_tail_dclus = 0;
+	__fat_cache_bump_id(i);
 }
 
 void fat_cache_inval_inode(struct inode *inode)
@@ -221,13 +573,175 @@ static inline void cache_init(struct fat_cache_id *cid, int fclus, int dclus)
 	cid->nr_contig = 0;
 }
 
+/*
+ * The inode remembers the last run of its chain, so that fat_chain_add()
+ * finds the end of the chain without walking it. A walk which reaches the
+ * EOF records it, and fat_cache_append() moves it on with each extension.
+ * Both go through ->cache_valid_id: an extension bumps it, so that a walk
+ * which started before can't record the old end of the chain.
+ */
+
+/*
+ * Returns FAT_ENT_EOF if "cluster" is beyond the known end of the chain,
+ * 0 if it is the last cluster, or -1 (*fclus and *dclus untouched). Also
+ * returns the id which fat_cache_set_tail() must find.
+ */
+static int fat_cache_tail(struct inode *inode, int cluster,
+			  int *fclus, int *dclus, unsigned int *id)
+{
+	struct msdos_inode_info *i = MSDOS_I(inode);
+	int ret = -1;
+
+	spin_lock(&i->cache_lru_lock);
+	*id = i->cache_valid_id;
+	if (i->i_tail_dclus &&
+	    cluster >= i->i_tail_fclus + i->i_tail_contig) {
+		*fclus = i->i_tail_fclus + i->i_tail_contig;
+		*dclus = i->i_tail_dclus + i->i_tail_contig;
+		ret = cluster > *fclus ? FAT_ENT_EOF : 0;
+	}
+	spin_unlock(&i->cache_lru_lock);
+	return ret;
+}
+
+/* The walk found the EOF at fclus/dclus, in the run of "cid" */
+static void fat_cache_set_tail(struct inode *inode, unsigned int id,
+			       struct fat_cache_id *cid, int fclus, int dclus)
+{
+	struct msdos_inode_info *i = MSDOS_I(inode);
+
+	spin_lock(&i->cache_lru_lock);
+	if (id == i->cache_valid_id) {
+		if (cid->fcluster >= 0 &&
+		    fclus - cid->fcluster == dclus - cid->dcluster) {
+			i->i_tail_fclus = cid->fcluster;
+			i->i_tail_dclus = cid->dcluster;
+			i->i_tail_contig = fclus - cid->fcluster;
+		} else {
+			i->i_tail_fclus = fclus;
+			i->i_tail_dclus = dclus;
+			i->i_tail_contig = 0;
+		}
+	}
+	spin_unlock(&i->cache_lru_lock);
+}
+
+/*
+ * fat_chain_add() linked a chain of "nr_cluster" clusters starting at
+ * dclus as the cluster fclus of the file. Extends the last run, and puts
+ * it into the cache. Only the first cluster of the new chain is known, so
+ * the end of the chain is forgotten if it has more.
+ */
+void fat_cache_append(struct inode *inode, int fclus, int dclus,
+		      int nr_cluster)
+{
+	struct msdos_inode_info *i = MSDOS_I(inode);
+	struct fat_cache_id cid;
+
+	spin_lock(&i->cache_lru_lock);
+	if (i->i_tail_dclus &&
+	    i->i_tail_fclus + i->i_tail_contig + 1 == fclus &&
+	    i->i_tail_dclus + i->i_tail_contig + 1 == dclus)
+		i->i_tail_contig++;
+	else {
+		i->i_tail_fclus = fclus;
+		i->i_tail_dclus = dclus;
+		i->i_tail_contig = 0;
+	}
+	__fat_cache_bump_id(i);
+	cid.id = i->cache_valid_id;
+	cid.fcluster = i->i_tail_fclus;
+	cid.dcluster = i->i_tail_dclus;
+	cid.nr_contig = i->i_tail_contig;
+	if (nr_cluster > 1)
+		i->i_tail_dclus = 0;
+	spin_unlock(&i->cache_lru_lock);
+
+	/* The lookups start from i_start anyway */
+	if (cid.fcluster)
+		fat_cache_add(inode, &cid);
+}
+
+/*
+ * Copies up to "max" runs of the extent map into "runs", in the order of
+ * the file. Returns the number of runs in the map.
+ */
+int fat_cache_get_extents(struct inode *inode, struct fat_map_run *runs,
+			  int max)
+{
+	struct msdos_inode_info *i = MSDOS_I(inode);
+	struct fat_extent *ext;
+	struct rb_node *n;
+	int nr = 0;
+
+	spin_lock(&i->cache_lru_lock);
+	for (n = rb_first(&i->i_extents); n; n = rb_next(n), nr++) {
+		if (nr >= max)
+			continue;
+		ext = rb_entry(n, struct fat_extent, rb_node);
+		runs[nr].fcluster = ext->fcluster;
+		runs[nr].dcluster = ext->dcluster;
+		runs[nr].nr_contig = ext->nr_contig;
+	}
+	spin_unlock(&i->cache_lru_lock);
+	return nr;
+}
+
+/* Puts a run of the chain, known to be valid, into the cache */
+void fat_cache_set_extent(struct inode *inode, const struct fat_map_run *run)
+{
+	struct fat_cache_id cid;
+
+	cache_init(&cid, run->fcluster, run->dcluster);
+	cid.nr_contig = run->nr_contig;
+	fat_cache_add(inode, &cid);
+}
+
+/*
+ * A walk got to the cluster fclus/dclus of the run "cid". Follows the chain
+ * on, as long as the FAT blocks are in memory (the walk started reading
+ * them ahead), and puts what it finds into the cache. A sequential reader
+ * then finds its next clusters there, without waiting for the FAT.
+ */
+#define FAT_AHEAD_CLUSTERS	64
+#define FAT_AHEAD_RUNS		4
+
+static void fat_cache_ahead(struct inode *inode, struct fat_entry *fatent,
+			    struct fat_cache_id *cid, int fclus, int dclus,
+			    unsigned int tail_id)
+{
+	int nr, n, nr_runs = 0;
+
+	for (n = 0; n < FAT_AHEAD_CLUSTERS; n++) {
+		nr = fat_ent_read_cached(inode, fatent, dclus);
+		if (nr < 0 || nr == FAT_ENT_FREE)
+			break;
+		else if (nr == FAT_ENT_EOF) {
+			fat_cache_set_tail(inode, tail_id, cid, fclus, dclus);
+			break;
+		}
+		fclus++;
+		dclus = nr;
+		if (!cache_contiguous(cid, dclus)) {
+			cid->nr_contig--;
+			fat_cache_add(inode, cid);
+			if (++nr_runs == FAT_AHEAD_RUNS)
+				return;
+			cache_init(cid, fclus, dclus);
+		}
+	}
+	fat_cache_add(inode, cid);
+}
+
 int fat_get_cluster(struct inode *inode, int cluster, int *fclus, int *dclus)
 {
 	struct super_block *sb = inode->i_sb;
 	const int limit = sb->s_maxbytes >> MSDOS_SB(sb)->cluster_bits;
 	struct fat_entry fatent;
 	struct fat_cache_id cid;
-	int nr;
+	struct fat_chain_ra ra = { 0, 0 };
+	unsigned int tail_id;
+	int nr, nr_runs = 0, start;
 
 	BUG_ON(MSDOS_I(inode)->i_start == 0);
 
@@ -236,6 +750,10 @@ int fat_get_cluster(struct inode *inode, int cluster, int *fclus, int *dclus)
 	if (cluster == 0)
 		return 0;
 
+	nr = fat_cache_tail(inode, cluster, fclus, dclus, &tail_id);
+	if (nr >= 0)
+		return nr;
+
 	if (fat_cache_lookup(inode, cluster, &cid, fclus, dclus) < 0) {
 		/*
 		 * dummy, always not contiguous
@@ -244,6 +762,7 @@ int fat_get_cluster(struct inode *inode, int cluster, int *fclus, int *dclus)
 		cache_init(&cid, -1, -1);
 	}
 
+	start = *fclus;
 	fatent_init(&fatent);
 	while (*fclus < cluster) {
 		/* prevent the infinite loop of cluster chain */
@@ -256,6 +775,7 @@ int fat_get_cluster(struct inode *inode, int cluster, int *fclus, int *dclus)
 			goto out;
 		}
 
+		fat_ent_chain_reada(sb, *dclus, &ra);
 		nr = fat_ent_read(inode, &fatent, *dclus);
 		if (nr < 0)
 			goto out;
@@ -267,16 +787,30 @@ int fat_get_cluster(struct inode *inode, int cluster, int *fclus, int *dclus)
 			nr = -EIO;
 			goto out;
 		} else if (nr == FAT_ENT_EOF) {
+			fat_cache_set_tail(inode, tail_id, &cid, *fclus, *dclus);
 			fat_cache_add(inode, &cid);
 			goto out;
 		}
 		(*fclus)++;
 		*dclus = nr;
-		if (!cache_contiguous(&cid, *dclus))
+		if (!cache_contiguous(&cid, *dclus)) {
+			/* The extent map keeps every run of the walk */
+			if (fat_use_extents(inode)) {
+				cid.nr_contig--;
+				fat_cache_add(inode, &cid);
+			}
 			cache_init(&cid, *fclus, *dclus);
+			nr_runs++;
+		}
 	}
 	nr = 0;
-	fat_cache_add(inode, &cid);
+	if (nr_runs > 1 && !fat_use_extents(inode))
+		fat_cache_miss(inode);
+	/* A lookup within the cached runs doesn't look ahead */
+	if (*fclus > start)
+		fat_cache_ahead(inode, &fatent, &cid, *fclus, *dclus, tail_id);
+	else
+		fat_cache_add(inode, &cid);
 out:
 	fatent_brelse(&fatent);
 	return nr;
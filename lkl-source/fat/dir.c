@@ -16,6 +16,7 @@
 #include <linux/slab.h>
 #include <linux/compat.h>
 #include <linux/uaccess.h>
+#include <linux/blkdev.h>
 #include "fat.h"
 #include <linux/syscalls.h>
 
@@ -45,27 +46,72 @@ static inline loff_t fat_make_i_pos(struct super_block *sb,
 		| (de - (struct msdos_dir_entry *)bh->b_data);
 }
 
-static inline void fat_dir_readahead(struct inode *dir, sector_t iblock,
-				     sector_t phys)
+/* Largest directory readahead window */
+#define FAT_DIR_RA_SIZE		(128 * 1024)
+
+/*
+ * Reads the directory ahead of the block at iblock, following its cluster
+ * chain. A scan from the start gets a window the size of the directory,
+ * up to FAT_DIR_RA_SIZE, which moves on once the cursor has got through
+ * half of it. The blocks contiguous on disk are plugged, so that they go
+ * in merged requests. Other accesses, like the lookups which read single
+ * records through the name index, only read their cluster ahead.
+ * ->i_dir_ra is only a hint: where the last window ended.
+ */
+static void fat_dir_readahead(struct inode *dir, sector_t iblock,
+			      sector_t phys)
 {
 	struct super_block *sb = dir->i_sb;
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct msdos_inode_info *i = MSDOS_I(dir);
 	struct buffer_head *bh;
-	int sec;
-
-	/* This is not a first sector of cluster, or sec_per_clus == 1 */
-	if ((iblock & (sbi->sec_per_clus - 1)) || sbi->sec_per_clus == 1)
+	struct blk_plug plug;
+	sector_t window, block, end;
+	unsigned long mapped_blocks, n;
+	int uptodate;
+
+	end = (i_size_read(dir) + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+	window = min_t(sector_t, end, FAT_DIR_RA_SIZE >> sb->s_blocksize_bits);
+	if (window <= 1)
 		return;
-	/* root dir of FAT12/FAT16 */
-	if ((sbi->fat_bits != 32) && (dir->i_ino == MSDOS_ROOT_INO))
+
+	block = i->i_dir_ra;
+	if (block <= iblock || block > iblock + window) {
+		/* Outside of the window: nothing to do in cached blocks */
+		bh = sb_find_get_block(sb, phys);
+		uptodate = bh && buffer_uptodate(bh);
+		brelse(bh);
+		if (uptodate)
+			return;
+		if (iblock && iblock != block) {
+			/* A seek: only the cluster, when we enter it */
+			if ((iblock & (sbi->sec_per_clus - 1)) ||
+			    sbi->sec_per_clus == 1)
+				return;
+			/* root dir of FAT12/FAT16 */
+			if (sbi->fat_bits != 32 && dir->i_ino == MSDOS_ROOT_INO)
+				return;
+			for (n = 0; n < sbi->sec_per_clus; n++)
+				sb_breadahead(sb, phys + n);
+			return;
+		}
+		block = iblock;
+	} else if (block - iblock > window / 2)
 		return;
+	end = min(end, iblock + window);
 
-	bh = sb_find_get_block(sb, phys);
-	if (bh == NULL || !buffer_uptodate(bh)) {
-		for (sec = 0; sec < sbi->sec_per_clus; sec++)
-			sb_breadahead(sb, phys + sec);
+	blk_start_plug(&plug);
+	while (block < end) {
+		if (fat_bmap(dir, block, &phys, &mapped_blocks, 0, false) ||
+		    !phys)
+			break;
+		mapped_blocks = min_t(sector_t, mapped_blocks, end - block);
+		for (n = 0; n < mapped_blocks; n++)
+			sb_breadahead(sb, phys + n);
+		block += mapped_blocks;
 	}
-	brelse(bh);
+	blk_finish_plug(&plug);
+	i->i_dir_ra = block;
 }
 
 /* Returns the inode number of the directory entry at offset pos. If bh is
@@ -139,6 +185,23 @@ static inline int fat_get_entry(struct inode *dir, loff_t *pos,
  * but ignore that right now.
  * Ahem... Stack smashing in ring 0 isn't fun. Fixed.
  */
+/*
+ * Copies the leading ASCII characters of uni, up to max of them, and
+ * returns how many there are. uni is only read up to its terminating
+ * zero: some callers have it at the end of an array.
+ */
+static inline int fat_uni_ascii(const wchar_t *uni, unsigned char *out,
+				int max)
+{
+	int n = 0;
+
+	while (n < max && uni[n] && uni[n] < 0x80) {
+		out[n] = uni[n];
+		n++;
+	}
+	return n;
+}
+
 static int uni16_to_x8(struct super_block *sb, unsigned char *ascii,
 		       const wchar_t *uni, int len, struct nls_table *nls)
 {
@@ -152,6 +215,14 @@ static int uni16_to_x8(struct super_block *sb, unsigned char *ascii,
 	op = ascii;
 
 	while (*ip && ((len - NLS_MAX_CHARSET_SIZE) > 0)) {
+		if (*ip < 0x80) {
+			charlen = fat_uni_ascii(ip, op,
+						len - NLS_MAX_CHARSET_SIZE);
+			ip += charlen;
+			op += charlen;
+			len -= charlen;
+			continue;
+		}
 		ec = *ip++;
 		charlen = nls->uni2char(ec, op, NLS_MAX_CHARSET_SIZE);
 		if (charlen > 0) {
@@ -183,10 +254,15 @@ static inline int fat_uni_to_x8(struct super_block *sb, const wchar_t *uni,
 				unsigned char *buf, int size)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	if (sbi->options.utf8)
-		return utf16s_to_utf8s(uni, FAT_MAX_UNI_CHARS,
-				UTF16_HOST_ENDIAN, buf, size);
-	else
+	int len;
+
+	if (sbi->options.utf8) {
+		len = fat_uni_ascii(uni, buf, size);
+		if (len < size && uni[len])
+			len += utf16s_to_utf8s(uni + len, FAT_MAX_UNI_CHARS - len,
+					UTF16_HOST_ENDIAN, buf + len, size - len);
+		return len;
+	} else
 		return uni16_to_x8(sb, buf, uni, size, sbi->nls_io);
 }
 
@@ -260,7 +336,7 @@ static inline int fat_name_match(struct msdos_sb_info *sbi,
 		return 0;
 
 	if (sbi->options.name_check != 's')
-		return !nls_strnicmp(sbi->nls_io, a, b, a_len);
+		return !fat_name_cmpi(sbi, a, b, a_len);
 	else
 		return !memcmp(a, b, a_len);
 }
@@ -458,45 +534,38 @@ static int fat_parse_short(struct super_block *sb,
 }
 
 /*
- * Return values: negative -> error/not found, 0 -> found.
+ * Parses the next record (the long name slots, if any, and the short
+ * entry) from *pos. On return *de is its short entry, the short name is in
+ * bufname, and the long name in *unicode if *nr_slots isn't zero.
+ * Returns 0, -ENOENT at the end of the directory, or an error.
  */
-int fat_search_long(struct inode *inode, const unsigned char *name,
-		    int name_len, struct fat_slot_info *sinfo)
+static int fat_get_record(struct inode *dir, loff_t *pos,
+			  struct buffer_head **bh, struct msdos_dir_entry **de,
+			  wchar_t **unicode, unsigned char *nr_slots,
+			  unsigned char *bufname, int *len)
 {
-	struct super_block *sb = inode->i_sb;
-	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	struct buffer_head *bh = NULL;
-	struct msdos_dir_entry *de;
-	unsigned char nr_slots;
-	wchar_t *unicode = NULL;
-	unsigned char bufname[FAT_MAX_SHORT_SIZE];
-	loff_t cpos = 0;
-	int err, len;
-
-	err = -ENOENT;
 	while (1) {
-		if (fat_get_entry(inode, &cpos, &bh, &de) == -1)
-			goto end_of_dir;
+		if (fat_get_entry(dir, pos, bh, de) == -1)
+			return -ENOENT;
 parse_record:
-		nr_slots = 0;
-		if (de->name[0] == DELETED_FLAG)
+		*nr_slots = 0;
+		if ((*de)->name[0] == DELETED_FLAG)
 			continue;
-		if (de->attr != ATTR_EXT && (de->attr & ATTR_VOLUME))
+		if ((*de)->attr != ATTR_EXT && ((*de)->attr & ATTR_VOLUME))
 			continue;
-		if (de->attr != ATTR_EXT && IS_FREE(de->name))
+		if ((*de)->attr != ATTR_EXT && IS_FREE((*de)->name))
 			continue;
-		if (de->attr == ATTR_EXT) {
-			int status = fat_parse_long(inode, &cpos, &bh, &de,
-						    &unicode, &nr_slots);
-			if (status < 0) {
-				err = status;
-				goto end_of_dir;
-			} else if (status == PARSE_INVALID)
+		if ((*de)->attr == ATTR_EXT) {
+			int status = fat_parse_long(dir, pos, bh, de,
+						    unicode, nr_slots);
+			if (status < 0)
+				return status;
+			else if (status == PARSE_INVALID)
 				continue;
 			else if (status == PARSE_NOT_LONGNAME)
 				goto parse_record;
 			else if (status == PARSE_EOF)
-				goto end_of_dir;
+				return -ENOENT;
 		}
 
 		/* Never prepend '.' to hidden files here.
@@ -504,24 +573,261 @@ parse_record:
 		 * 'dotsOK=yes'); if we are executing here, it is in the
 		 * context of a vfat mount.
 		 */
-		len = fat_parse_short(sb, de, bufname, 0);
-		if (len == 0)
+		*len = fat_parse_short(dir->i_sb, *de, bufname, 0);
+		if (*len == 0)
 			continue;
+		return 0;
+	}
+}
+
+/* Converts the long name parsed by fat_get_record() after the unicode */
+static inline unsigned char *fat_record_longname(struct super_block *sb,
+						 wchar_t *unicode, int *len)
+{
+	unsigned char *longname = (unsigned char *)(unicode + FAT_MAX_UNI_CHARS);
+
+	*len = fat_uni_to_x8(sb, unicode, longname,
+			     PATH_MAX - FAT_MAX_UNI_SIZE);
+	return longname;
+}
+
+/* Directories from this size on get a name index, see dirindex.c */
+#define FAT_DINDEX_MIN_SIZE	(16 * 1024)
+/* Records with the same name hash parsed by one indexed lookup */
+#define FAT_DINDEX_MAX_HITS	8
+
+/* Indexes the names of the record at slot_off, as parsed */
+static int fat_dindex_record(struct inode *dir, struct fat_dir_index *idx,
+			     loff_t slot_off, unsigned char nr_slots,
+			     wchar_t *unicode, unsigned char *bufname, int len)
+{
+	struct super_block *sb = dir->i_sb;
+	unsigned char *longname;
+	int err;
+
+	err = fat_dindex_add(idx, fat_dindex_hash(sb, bufname, len), slot_off);
+	if (!err && nr_slots) {
+		longname = fat_record_longname(sb, unicode, &len);
+		err = fat_dindex_add(idx, fat_dindex_hash(sb, longname, len),
+				     slot_off);
+	}
+	return err;
+}
+
+/* Builds the name index of "dir" with one pass over it */
+static struct fat_dir_index *fat_dindex_build(struct inode *dir)
+{
+	struct buffer_head *bh = NULL;
+	struct msdos_dir_entry *de;
+	struct fat_dir_index *idx;
+	unsigned char nr_slots;
+	wchar_t *unicode = NULL;
+	unsigned char bufname[FAT_MAX_SHORT_SIZE];
+	loff_t cpos = 0;
+	int err, len;
+
+	idx = fat_dindex_new(dir, dir->i_size >> MSDOS_DIR_BITS);
+	if (!idx)
+		return NULL;
+
+	while (!(err = fat_get_record(dir, &cpos, &bh, &de, &unicode,
+				      &nr_slots, bufname, &len))) {
+		err = fat_dindex_record(dir, idx,
+					cpos - (nr_slots + 1) * sizeof(*de),
+					nr_slots, unicode, bufname, len);
+		if (err)
+			break;
+	}
+	brelse(bh);
+	if (unicode)
+		__putname(unicode);
+	if (err != -ENOENT) {
+		fat_dindex_drop(dir);
+		return NULL;
+	}
+	return idx;
+}
+
+/* Adds the names of a record, as parsed, to the name filter */
+static void fat_dbloom_record(struct super_block *sb,
+			      struct fat_dir_bloom *bloom,
+			      unsigned char nr_slots, wchar_t *unicode,
+			      unsigned char *bufname, int len)
+{
+	unsigned char *longname;
+
+	fat_dbloom_add(bloom, fat_dindex_hash(sb, bufname, len));
+	if (nr_slots) {
+		longname = fat_record_longname(sb, unicode, &len);
+		fat_dbloom_add(bloom, fat_dindex_hash(sb, longname, len));
+	}
+}
+
+/*
+ * Adds the record fat_add_entries() just added at slot_off to the name
+ * index and filter, and to the 8.3 name set.
+ */
+static void fat_dindex_insert(struct inode *dir, loff_t slot_off)
+{
+	struct fat_dir_index *idx = fat_dindex_get(dir);
+	struct fat_dir_bloom *bloom = fat_dbloom_get(dir);
+	struct buffer_head *bh = NULL;
+	struct msdos_dir_entry *de;
+	unsigned char nr_slots;
+	wchar_t *unicode = NULL;
+	unsigned char bufname[FAT_MAX_SHORT_SIZE];
+	loff_t cpos = slot_off;
+	int err, len;
+
+	if (!idx && !bloom && !fat_dalias_get(dir))
+		return;
+	if (idx)
+		fat_dindex_rd_inval(idx, slot_off);
+	err = fat_get_record(dir, &cpos, &bh, &de, &unicode, &nr_slots,
+			     bufname, &len);
+	if (!err && cpos - (nr_slots + 1) * sizeof(*de) != slot_off)
+		err = -EIO;
+	if (!err && bloom) {
+		fat_dbloom_add(bloom, fat_dbloom_short_hash(dir->i_sb, de->name));
+		fat_dbloom_record(dir->i_sb, bloom, nr_slots, unicode,
+				  bufname, len);
+	}
+	if (!err && idx)
+		err = fat_dindex_record(dir, idx, slot_off, nr_slots,
+					unicode, bufname, len);
+	if (!err && fat_dalias_get(dir))
+		err = fat_dalias_add(dir, de->name, cpos - sizeof(*de));
+	brelse(bh);
+	if (unicode)
+		__putname(unicode);
+	/* Without this record, they would give wrong misses */
+	if (err) {
+		fat_dindex_drop(dir);
+		fat_dbloom_drop(dir);
+		fat_dalias_drop(dir);
+	}
+}
+
+/*
+ * Looks the name up in the records the index has for its hash. Returns 0,
+ * -ENOENT, or -EAGAIN if the linear search has to do it.
+ */
+static int fat_search_indexed(struct inode *inode, struct fat_dir_index *idx,
+			      const unsigned char *name, int name_len,
+			      u32 hash, struct fat_slot_info *sinfo)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct buffer_head *bh = NULL;
+	struct msdos_dir_entry *de;
+	unsigned char nr_slots, *longname;
+	wchar_t *unicode = NULL;
+	unsigned char bufname[FAT_MAX_SHORT_SIZE];
+	loff_t slot_offs[FAT_DINDEX_MAX_HITS], cpos;
+	int i, nr, err, len;
+
+	nr = fat_dindex_find(idx, hash, slot_offs, FAT_DINDEX_MAX_HITS);
+	if (nr < 0)
+		return -EAGAIN;
+
+	err = -ENOENT;
+	for (i = 0; i < nr; i++) {
+		cpos = slot_offs[i];
+		err = fat_get_record(inode, &cpos, &bh, &de, &unicode,
+				     &nr_slots, bufname, &len);
+		if (err == -ENOENT)
+			continue;
+		else if (err)
+			break;
+		err = -ENOENT;
+		/* Not the record the index knows */
+		if (cpos - (nr_slots + 1) * sizeof(*de) != slot_offs[i])
+			continue;
+
+		if (fat_name_match(sbi, name, name_len, bufname, len))
+			goto found;
+		if (nr_slots) {
+			longname = fat_record_longname(sb, unicode, &len);
+			if (fat_name_match(sbi, name, name_len, longname, len))
+				goto found;
+		}
+	}
+	brelse(bh);
+	goto out;
+
+found:
+	nr_slots++;	/* include the de */
+	sinfo->slot_off = cpos - nr_slots * sizeof(*de);
+	sinfo->nr_slots = nr_slots;
+	sinfo->de = de;
+	sinfo->bh = bh;
+	sinfo->i_pos = fat_make_i_pos(sb, sinfo->bh, sinfo->de);
+	err = 0;
+out:
+	if (unicode)
+		__putname(unicode);
+	return err;
+}
+
+/*
+ * Return values: negative -> error/not found, 0 -> found.
+ */
+int fat_search_long(struct inode *inode, const unsigned char *name,
+		    int name_len, struct fat_slot_info *sinfo)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_dir_index *idx;
+	struct fat_dir_bloom *bloom;
+	struct buffer_head *bh = NULL;
+	struct msdos_dir_entry *de;
+	unsigned char nr_slots, *longname;
+	wchar_t *unicode = NULL;
+	unsigned char bufname[FAT_MAX_SHORT_SIZE];
+	loff_t cpos = 0;
+	u32 hash = fat_dindex_hash(sb, name, name_len);
+	int err, len;
+
+	bloom = fat_dbloom_get(inode);
+	if (bloom && !fat_dbloom_test(bloom, FAT_DBLOOM_NAME, hash))
+		return -ENOENT;
+
+	idx = fat_dindex_get(inode);
+	if (!idx && inode->i_size >= FAT_DINDEX_MIN_SIZE)
+		idx = fat_dindex_build(inode);
+	if (idx) {
+		err = fat_search_indexed(inode, idx, name, name_len, hash,
+					 sinfo);
+		if (err != -EAGAIN)
+			return err;
+	}
+
+	/* Fill the name filter in as the scan goes */
+	if (!bloom)
+		bloom = fat_dbloom_new(inode);
+	while (!(err = fat_get_record(inode, &cpos, &bh, &de, &unicode,
+				      &nr_slots, bufname, &len))) {
+		if (fat_dbloom_want(bloom, FAT_DBLOOM_NAME,
+				    cpos - (nr_slots + 1) * sizeof(*de))) {
+			fat_dbloom_record(sb, bloom, nr_slots, unicode,
+					  bufname, len);
+			fat_dbloom_scanned(bloom, FAT_DBLOOM_NAME, cpos);
+		}
 
 		/* Compare shortname */
 		if (fat_name_match(sbi, name, name_len, bufname, len))
 			goto found;
 
 		if (nr_slots) {
-			void *longname = unicode + FAT_MAX_UNI_CHARS;
-			int size = PATH_MAX - FAT_MAX_UNI_SIZE;
-
 			/* Compare longname */
-			len = fat_uni_to_x8(sb, unicode, longname, size);
+			longname = fat_record_longname(sb, unicode, &len);
 			if (fat_name_match(sbi, name, name_len, longname, len))
 				goto found;
 		}
 	}
+	if (err == -ENOENT)
+		fat_dbloom_complete(bloom, FAT_DBLOOM_NAME);
+	goto end_of_dir;
 
 found:
 	nr_slots++;	/* include the de */
@@ -550,6 +856,57 @@ struct fat_ioctl_filldir_callback {
 	int short_len;
 };
 
+/*
+ * Emits the records the index has decoded, from *cpos on. Returns 1 if
+ * dir_emit() is full, 0 when the rest has to be parsed from *cpos, which
+ * is then the end of the decoded records if it was one of them.
+ */
+static int fat_readdir_decoded(struct inode *inode, struct file *file,
+			       struct dir_context *ctx,
+			       struct fat_dir_index *idx, loff_t *cpos,
+			       int *fake_offset)
+{
+	struct super_block *sb = inode->i_sb;
+	const struct fat_rd_ent *ent;
+	const unsigned char *name;
+	unsigned long inum;
+	struct inode *tmp;
+	int i;
+
+	i = fat_dindex_rd_find(idx, *cpos);
+	if (i < 0 || *cpos == fat_dindex_rd_end(idx))
+		return 0;
+
+	for (; (ent = fat_dindex_rd_ent(idx, i, &name)) != NULL; i++) {
+		ctx->pos = ent->start;
+		if (*fake_offset && ctx->pos < 2)
+			ctx->pos = 2;
+
+		if (ent->type == FAT_RD_DOT) {
+			if (!dir_emit_dot(file, ctx))
+				return 1;
+		} else if (ent->type == FAT_RD_DOTDOT) {
+			if (!dir_emit_dotdot(file, ctx))
+				return 1;
+		} else {
+			tmp = fat_iget(sb, ent->i_pos);
+			if (tmp) {
+				inum = tmp->i_ino;
+				iput(tmp);
+			} else
+				inum = iunique(sb, MSDOS_ROOT_INO);
+			if (!dir_emit(ctx, name, ent->name_len, inum,
+				      ent->type))
+				return 1;
+		}
+		*fake_offset = 0;
+		ctx->pos = ent->end;
+	}
+	*cpos = fat_dindex_rd_end(idx);
+	ctx->pos = *cpos;
+	return 0;
+}
+
 static int __fat_readdir(struct inode *inode, struct file *file,
 			 struct dir_context *ctx, int short_only,
 			 struct fat_ioctl_filldir_callback *both)
@@ -563,7 +920,9 @@ static int __fat_readdir(struct inode *inode, struct file *file,
 	unsigned char bufname[FAT_MAX_SHORT_SIZE];
 	int isvfat = sbi->options.isvfat;
 	const char *fill_name = NULL;
-	int fake_offset = 0;
+	struct fat_dir_index *idx = NULL;
+	struct fat_rd_ent ent;
+	int fake_offset = 0, rd_append = 0;
 	loff_t cpos;
 	int short_len = 0, fill_len = 0;
 	int ret = 0;
@@ -585,6 +944,20 @@ static int __fat_readdir(struct inode *inode, struct file *file,
 		goto out;
 	}
 
+	/* Plain listings of big directories reuse the decoded records */
+	if (isvfat && !short_only && !both &&
+	    inode->i_size >= FAT_DINDEX_MIN_SIZE) {
+		idx = fat_dindex_get(inode);
+		if (!idx)
+			idx = fat_dindex_build(inode);
+	}
+	if (idx) {
+		if (fat_readdir_decoded(inode, file, ctx, idx, &cpos,
+					&fake_offset))
+			goto out;
+		rd_append = cpos == fat_dindex_rd_end(idx);
+	}
+
 	bh = NULL;
 get_new:
 	if (fat_get_entry(inode, &cpos, &bh, &de) == -1)
@@ -656,6 +1029,21 @@ parse_record:
 
 start_filldir:
 	ctx->pos = cpos - (nr_slots + 1) * sizeof(struct msdos_dir_entry);
+	if (rd_append) {
+		ent.start = ctx->pos;
+		ent.end = cpos;
+		ent.i_pos = fat_make_i_pos(sb, bh, de);
+		ent.name_len = fill_len;
+		if (!memcmp(de->name, MSDOS_DOT, MSDOS_NAME))
+			ent.type = FAT_RD_DOT;
+		else if (!memcmp(de->name, MSDOS_DOTDOT, MSDOS_NAME))
+			ent.type = FAT_RD_DOTDOT;
+		else
+			ent.type = (de->attr & ATTR_DIR) ? DT_DIR : DT_REG;
+		if (fat_dindex_rd_add(idx, &ent,
+				      (const unsigned char *)fill_name))
+			rd_append = 0;
+	}
 	if (fake_offset && ctx->pos < 2)
 		ctx->pos = 2;
 
@@ -682,9 +1070,13 @@ start_filldir:
 record_end:
 	fake_offset = 0;
 	ctx->pos = cpos;
+	if (rd_append)
+		fat_dindex_rd_set_end(idx, cpos);
 	goto get_new;
 
 end_of_dir:
+	if (rd_append && !ret)
+		fat_dindex_rd_set_end(idx, cpos);
 	if (fake_offset && cpos < 2)
 		ctx->pos = 2;
 	else
@@ -912,6 +1304,58 @@ int fat_get_dotdot_entry(struct inode *dir, struct buffer_head **bh,
 }
 EXPORT_SYMBOL_GPL(fat_get_dotdot_entry);
 
+/*
+ * Points the "." entry of dir and the ".." entries of its subdirectories
+ * to the current i_logstart of dir, after its cluster chain was moved.
+ * The caller has to prevent the directory from changing.
+ */
+int fat_dir_relink(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct buffer_head *bh, *sub_bh;
+	struct msdos_dir_entry *de, *sub_de;
+	int start = MSDOS_I(dir)->i_logstart;
+	int sub, err = 0;
+	loff_t cpos;
+
+	bh = NULL;
+	cpos = 0;
+	while (fat_get_short_entry(dir, &cpos, &bh, &de) >= 0) {
+		if (!(de->attr & ATTR_DIR))
+			continue;
+		if (!strncmp(de->name, MSDOS_DOT, MSDOS_NAME)) {
+			fat_set_start(de, start);
+			mark_buffer_dirty_inode(bh, dir);
+			continue;
+		}
+		if (!strncmp(de->name, MSDOS_DOTDOT, MSDOS_NAME))
+			continue;
+
+		sub = fat_get_start(sbi, de);
+		if (sub < FAT_START_ENT || sub >= sbi->max_cluster)
+			continue;
+		sub_bh = sb_bread(sb, fat_clus_to_blknr(sbi, sub));
+		if (!sub_bh) {
+			err = -EIO;
+			break;
+		}
+		/* ".." is always the second entry */
+		sub_de = (struct msdos_dir_entry *)sub_bh->b_data + 1;
+		if (!strncmp(sub_de->name, MSDOS_DOTDOT, MSDOS_NAME)) {
+			fat_set_start(sub_de, start);
+			mark_buffer_dirty(sub_bh);
+			if (IS_DIRSYNC(dir))
+				err = sync_dirty_buffer(sub_bh);
+		}
+		brelse(sub_bh);
+		if (err)
+			break;
+	}
+	brelse(bh);
+	return err;
+}
+
 /* See if directory is empty */
 int fat_dir_empty(struct inode *dir)
 {
@@ -959,15 +1403,95 @@ int fat_subdirs(struct inode *dir)
  * Scans a directory for a given file (name points to its formatted name).
  * Returns an error code or zero.
  */
+/* Directories from this size on get a set of their 8.3 names */
+#define FAT_DALIAS_MIN_SIZE	(16 * 1024)
+
+/* Builds the 8.3 name set of "dir" with one pass over it */
+static struct fat_dir_aliases *fat_dalias_build(struct inode *dir)
+{
+	struct fat_dir_aliases *aliases;
+	struct buffer_head *bh = NULL;
+	struct msdos_dir_entry *de;
+	loff_t pos = 0;
+	int err = 0;
+
+	aliases = fat_dalias_new(dir);
+	if (!aliases)
+		return NULL;
+
+	while (fat_get_short_entry(dir, &pos, &bh, &de) >= 0) {
+		err = fat_dalias_add(dir, de->name, pos - sizeof(*de));
+		if (err)
+			break;
+	}
+	brelse(bh);
+	if (err) {
+		fat_dalias_drop(dir);
+		return NULL;
+	}
+	return aliases;
+}
+
+/* Looks the 8.3 name up in the set of "dir", if it has one */
+static int fat_scan_aliases(struct inode *dir, const unsigned char *name,
+			    struct fat_slot_info *sinfo)
+{
+	struct super_block *sb = dir->i_sb;
+	loff_t pos;
+	int err;
+
+	if (!fat_dalias_get(dir) &&
+	    (dir->i_size < FAT_DALIAS_MIN_SIZE || !fat_dalias_build(dir)))
+		return -EAGAIN;
+
+	err = fat_dalias_find(dir, name, &sinfo->slot_off);
+	if (err)
+		return err;
+
+	pos = sinfo->slot_off;
+	sinfo->bh = NULL;
+	if (fat_get_short_entry(dir, &pos, &sinfo->bh, &sinfo->de) >= 0 &&
+	    pos - sizeof(*sinfo->de) == sinfo->slot_off &&
+	    !strncmp(sinfo->de->name, name, MSDOS_NAME)) {
+		sinfo->nr_slots = 1;
+		sinfo->i_pos = fat_make_i_pos(sb, sinfo->bh, sinfo->de);
+		return 0;
+	}
+	/* The set is wrong, search the directory */
+	brelse(sinfo->bh);
+	fat_dalias_drop(dir);
+	return -EAGAIN;
+}
+
 int fat_scan(struct inode *dir, const unsigned char *name,
 	     struct fat_slot_info *sinfo)
 {
 	struct super_block *sb = dir->i_sb;
+	struct fat_dir_bloom *bloom;
+	int err;
+
+	err = fat_scan_aliases(dir, name, sinfo);
+	if (err != -EAGAIN)
+		return err;
+
+	bloom = fat_dbloom_get(dir);
+	if (bloom && !fat_dbloom_test(bloom, FAT_DBLOOM_SHORT,
+				      fat_dbloom_short_hash(sb, name)))
+		return -ENOENT;
+	if (!bloom)
+		bloom = fat_dbloom_new(dir);
 
 	sinfo->slot_off = 0;
 	sinfo->bh = NULL;
 	while (fat_get_short_entry(dir, &sinfo->slot_off, &sinfo->bh,
 				   &sinfo->de) >= 0) {
+		if (fat_dbloom_want(bloom, FAT_DBLOOM_SHORT,
+				    sinfo->slot_off - sizeof(*sinfo->de))) {
+			fat_dbloom_add(bloom,
+				fat_dbloom_short_hash(sb, sinfo->de->name));
+			fat_dbloom_scanned(bloom, FAT_DBLOOM_SHORT,
+					   sinfo->slot_off);
+		}
 		if (!strncmp(sinfo->de->name, name, MSDOS_NAME)) {
 			sinfo->slot_off -= sizeof(*sinfo->de);
 			sinfo->nr_slots = 1;
@@ -975,6 +1499,7 @@ int fat_scan(struct inode *dir, const unsigned char *name,
 			return 0;
 		}
 	}
+	fat_dbloom_complete(bloom, FAT_DBLOOM_SHORT);
 	return -ENOENT;
 }
 EXPORT_SYMBOL_GPL(fat_scan);
@@ -1003,6 +1528,55 @@ int fat_scan_logstart(struct inode *dir, int i_logstart,
 }
 
 
+/* Directories from this size on get a map of their free entries */
+#define FAT_DHOLES_MIN_SIZE	(16 * 1024)
+
+/* Builds the free entry map of "dir" with one pass over it */
+static struct fat_dir_holes *fat_dholes_build(struct inode *dir)
+{
+	struct fat_dir_holes *holes;
+	struct buffer_head *bh = NULL;
+	struct msdos_dir_entry *de;
+	loff_t pos = 0, start = 0;
+	int nr = 0, err = 0;
+
+	holes = fat_dholes_new(dir);
+	if (!holes)
+		return NULL;
+
+	while (fat_get_entry(dir, &pos, &bh, &de) > -1) {
+		if (IS_FREE(de->name)) {
+			if (!nr++)
+				start = pos - sizeof(*de);
+			continue;
+		}
+		if (nr) {
+			err = fat_dholes_free(holes, start, nr);
+			if (err)
+				break;
+			nr = 0;
+		}
+	}
+	brelse(bh);
+	if (!err && nr)
+		err = fat_dholes_free(holes, start, nr);
+	if (err) {
+		fat_dholes_drop(dir);
+		return NULL;
+	}
+	return holes;
+}
+
+/* Gives the "nr" entries from pos, now free, back to the map */
+static void fat_dholes_release(struct inode *dir, loff_t pos, int nr)
+{
+	struct fat_dir_holes *holes = fat_dholes_get(dir);
+
+	/* Without them, the map would only miss free entries */
+	if (holes && fat_dholes_free(holes, pos, nr))
+		fat_dholes_drop(dir);
+}
+
 static int __fat_remove_entries(struct inode *dir, loff_t pos, int nr_slots)
 {
 	struct super_block *sb = dir->i_sb;
@@ -1033,6 +1607,8 @@ static int __fat_remove_entries(struct inode *dir, loff_t pos, int nr_slots)
 			
 			printk(KERN_INFO "__fat_remove_entries called\n");
 		}
+		fat_dholes_release(dir, pos - sizeof(*de),
+				   orig_slots - nr_slots);
 		mark_buffer_dirty_inode(bh, dir);
 		if (IS_DIRSYNC(dir))
 			err = sync_dirty_buffer(bh);
@@ -1050,6 +1626,7 @@ static int __fat_remove_entries(struct inode *dir, loff_t pos, int nr_slots)
 int fat_remove_entries(struct inode *dir, struct fat_slot_info *sinfo)
 {
 	struct super_block *sb = dir->i_sb;
+	struct fat_dir_index *idx;
 	struct msdos_dir_entry *de;
 	struct buffer_head *bh;
 	int err = 0, nr_slots;
@@ -1063,11 +1640,21 @@ int fat_remove_entries(struct inode *dir, struct fat_slot_info *sinfo)
 	sinfo->de = NULL;
 	bh = sinfo->bh;
 	sinfo->bh = NULL;
+	idx = fat_dindex_get(dir);
+	if (idx) {
+		fat_dindex_remove(idx, sinfo->slot_off);
+		fat_dindex_rd_inval(idx, sinfo->slot_off);
+	}
+	if (fat_dalias_get(dir))
+		fat_dalias_remove(dir, de->name, sinfo->slot_off +
+				  (sinfo->nr_slots - 1) * sizeof(*de));
 	while (nr_slots && de >= (struct msdos_dir_entry *)bh->b_data) {
 		de->name[0] = DELETED_FLAG;
 		de--;
 		nr_slots--;
 	}
+	fat_dholes_release(dir, sinfo->slot_off + nr_slots * sizeof(*de),
+			   sinfo->nr_slots - nr_slots);
 	mark_buffer_dirty_inode(bh, dir);
 	if (IS_DIRSYNC(dir))
 		err = sync_dirty_buffer(bh);
@@ -1300,8 +1887,9 @@ int fat_add_entries(struct inode *dir, void *slots, int nr_slots,
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	struct buffer_head *bh, *prev, *bhs[3]; /* 32*slots (672bytes) */
 	struct msdos_dir_entry *uninitialized_var(de);
-	int err, free_slots, i, nr_bhs;
-	loff_t pos, i_pos;
+	struct fat_dir_holes *holes;
+	int err, free_slots, i, nr_bhs, nr_free;
+	loff_t pos, i_pos, end;
 
 	sinfo->nr_slots = nr_slots;
 
@@ -1310,6 +1898,38 @@ int fat_add_entries(struct inode *dir, void *slots, int nr_slots,
 	bh = prev = NULL;
 	pos = 0;
 	err = -ENOSPC;
+	holes = fat_dholes_get(dir);
+	if (!holes && dir->i_size >= FAT_DHOLES_MIN_SIZE)
+		holes = fat_dholes_build(dir);
+	if (holes) {
+		pos = fat_dholes_take(holes, nr_slots, dir->i_size, &nr_free);
+		while (free_slots < nr_free) {
+			if (fat_get_entry(dir, &pos, &bh, &de) < 0 ||
+			    !IS_FREE(de->name)) {
+				/* The map is wrong, search the directory */
+				for (i = 0; i < nr_bhs; i++)
+					brelse(bhs[i]);
+				prev = NULL;
+				free_slots = nr_bhs = 0;
+				pos = 0;
+				fat_dholes_drop(dir);
+				goto search;
+			}
+			if (prev != bh) {
+				get_bh(bh);
+				bhs[nr_bhs] = prev = bh;
+				nr_bhs++;
+			}
+			free_slots++;
+		}
+		if (free_slots == nr_slots)
+			goto found;
+		/* The rest goes at the end, in new clusters */
+		if (dir->i_size >= FAT_MAX_DIR_SIZE)
+			goto error;
+		goto end_of_dir;
+	}
+search:
 	while (fat_get_entry(dir, &pos, &bh, &de) > -1) {
 		/* check the maximum size of directory */
 		if (pos >= FAT_MAX_DIR_SIZE)
@@ -1331,6 +1951,7 @@ int fat_add_entries(struct inode *dir, void *slots, int nr_slots,
 			free_slots = nr_bhs = 0;
 		}
 	}
+end_of_dir:
 	if (dir->i_ino == MSDOS_ROOT_INO) {
 		if (sbi->fat_bits != 32)
 			goto error;
@@ -1388,6 +2009,7 @@ found:
 		 * And initialize the cluster with new entries, then
 		 * add the cluster to dir.
 		 */
+		end = dir->i_size;
 		cluster = fat_add_new_entries(dir, slots, nr_slots, &nr_cluster,
 					      &de, &bh, &i_pos);
 		if (cluster < 0) {
@@ -1406,11 +2028,17 @@ found:
 		}
 		dir->i_size += nr_cluster << sbi->cluster_bits;
 		MSDOS_I(dir)->mmu_private += nr_cluster << sbi->cluster_bits;
+		/* The rest of the new clusters is free */
+		end += nr_slots * sizeof(*de);
+		if (end < dir->i_size)
+			fat_dholes_release(dir, end,
+				(dir->i_size - end) >> MSDOS_DIR_BITS);
 	}
 	sinfo->slot_off = pos;
 	sinfo->de = de;
 	sinfo->bh = bh;
 	sinfo->i_pos = fat_make_i_pos(sb, sinfo->bh, sinfo->de);
+	fat_dindex_insert(dir, pos);
 
 	return 0;
 
@@ -1418,6 +2046,10 @@ error:
 	brelse(bh);
 	for (i = 0; i < nr_bhs; i++)
 		brelse(bhs[i]);
+	/* Give back the entries taken from the map */
+	if (free_slots)
+		fat_dholes_release(dir, pos - free_slots * sizeof(*de),
+				   free_slots);
 	return err;
 
 error_remove:
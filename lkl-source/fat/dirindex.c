@@ -0,0 +1,916 @@
+/*
+ *  linux/fs/fat/dirindex.c
+ *
+ *  In-memory indexes of the names of directories.
+ *
+ *  fat_search_long() has to parse every record of a directory until it
+ *  finds the name. For directories of FAT_DINDEX_MIN_SIZE or more, the
+ *  first lookup parses all of them once and indexes the hash of each name
+ *  (long and short) by the offset of its record. Later lookups only parse
+ *  the records with the same hash. The index also keeps the records
+ *  __fat_readdir() has decoded, from the start of the directory on, so
+ *  that listing it again doesn't parse the long names again.
+ *  fat_add_entries() and fat_remove_entries() keep the index up to date,
+ *  dropping the decoded records from the one they change on, and a
+ *  shrinker drops the indexes not used lately.
+ *
+ *  Every directory also gets a Bloom filter of its names, filled in by
+ *  the scans of fat_search_long() and fat_scan() as they go and by
+ *  fat_add_entries(). Once a scan has reached the end of the directory,
+ *  the filter answers most lookups of names which aren't there without
+ *  reading the directory. Removing a name leaves its bits set, which only
+ *  costs false positives; a filter with too many keys is dropped and
+ *  built again. At 16 bits per directory entry, a filter takes 1/16 of
+ *  the size of its directory and lives as long as the inode.
+ *
+ *  For fat_add_entries(), big directories get a map of their runs of free
+ *  entries, by offset and by length, built with one pass over the
+ *  directory. fat_add_entries() takes the entries it needs from a run
+ *  long enough, and the removals give them back. Like the filter, the map
+ *  lives as long as the inode.
+ *
+ *  fat_scan() looks 8.3 entry names up, among others for each numeric tail
+ *  vfat_create_shortname() tries. Big directories get a set of their 8.3
+ *  names, with the offset of their entry, so that these lookups don't
+ *  read the directory; fat_add_entries() and fat_remove_entries() keep it
+ *  up to date. It also lives as long as the inode.
+ *
+ *  All this is serialized by sbi->s_lock, like the rest of the directory
+ *  operations.
+ */
+
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/sched/mm.h>
+#include "fat.h"
+
+struct fat_dindex_ent {
+	struct hlist_node name_node;	/* in ->names, by hash */
+	struct hlist_node slot_node;	/* in ->slots, by slot_off */
+	u32 hash;
+	loff_t slot_off;		/* of the first slot of the record */
+};
+
+struct fat_dir_index {
+	struct list_head lru;		/* on fat_dindex_lru */
+	struct inode *dir;
+	int referenced;			/* used since the shrinker saw it */
+	unsigned int bits;
+	unsigned long nr_ents;
+	struct hlist_head *names;
+	struct hlist_head *slots;
+	/* records decoded by __fat_readdir(), up to rd_end */
+	struct fat_rd_ent *rd_ents;
+	unsigned int rd_nr, rd_max;
+	unsigned char *rd_names;
+	unsigned int rd_names_len, rd_names_max;
+	loff_t rd_end;
+};
+
+struct fat_dir_bloom {
+	unsigned int bits;		/* log2 of the size of map, in bits */
+	unsigned int nr_keys;
+	unsigned int complete;		/* key spaces with all their keys */
+	loff_t scanned[FAT_DBLOOM_SPACES]; /* keys are in up to there */
+	unsigned long map[];
+};
+
+/* A run of free entries */
+struct fat_dir_hole {
+	struct rb_node rb_node;		/* in ->runs, by start */
+	struct list_head list;		/* in ->by_len[] */
+	loff_t start;
+	int len;			/* in entries */
+};
+
+struct fat_dir_holes {
+	struct rb_root runs;
+	/* runs of 1 .. MSDOS_SLOTS - 1 entries, and of MSDOS_SLOTS or more */
+	struct list_head by_len[MSDOS_SLOTS];
+};
+
+/* An 8.3 name, see fat_dalias_*() */
+struct fat_dir_alias {
+	struct hlist_node node;
+	loff_t slot_off;		/* of the short entry */
+	unsigned char name[MSDOS_NAME];
+};
+
+struct fat_dir_aliases {
+	unsigned int bits;
+	unsigned long nr;
+	struct hlist_head *table;
+};
+
+#define FAT_DINDEX_MIN_BITS	6
+#define FAT_DINDEX_MAX_BITS	16
+
+static struct kmem_cache *fat_dindex_cachep;
+static LIST_HEAD(fat_dindex_lru);
+static DEFINE_SPINLOCK(fat_dindex_lock);	/* fat_dindex_lru, ->i_dindex */
+static atomic_long_t fat_dindex_nr_ents;
+
+/* Hash of the name as fat_name_match() compares it */
+u32 fat_dindex_hash(struct super_block *sb, const unsigned char *name, int len)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	unsigned long hash = init_name_hash(sb);
+	int i;
+
+	if (sbi->options.name_check != 's')
+		return fat_name_hashi(sbi, sb, name, len);
+	for (i = 0; i < len; i++)
+		hash = partial_name_hash(name[i], hash);
+	return end_name_hash(hash);
+}
+
+static inline unsigned int fat_dindex_slot_hash(struct fat_dir_index *idx,
+						loff_t slot_off)
+{
+	return hash_32(slot_off >> MSDOS_DIR_BITS, idx->bits);
+}
+
+static struct hlist_head *fat_dindex_alloc_table(unsigned int bits)
+{
+	struct hlist_head *table;
+	unsigned int i;
+
+	table = kmalloc_array(1U << bits, sizeof(*table),
+			      GFP_NOFS | __GFP_NOWARN);
+	if (table) {
+		for (i = 0; i < (1U << bits); i++)
+			INIT_HLIST_HEAD(&table[i]);
+	}
+	return table;
+}
+
+/* Doubles the hash tables. If that fails, the chains only get longer. */
+static void fat_dindex_grow(struct fat_dir_index *idx)
+{
+	struct hlist_head *names, *slots, *old_names = idx->names;
+	struct fat_dindex_ent *ent;
+	struct hlist_node *n;
+	unsigned int i, old_bits = idx->bits;
+
+	names = fat_dindex_alloc_table(old_bits + 1);
+	slots = fat_dindex_alloc_table(old_bits + 1);
+	if (!names || !slots) {
+		kfree(names);
+		kfree(slots);
+		return;
+	}
+
+	idx->bits = old_bits + 1;
+	for (i = 0; i < (1U << old_bits); i++) {
+		hlist_for_each_entry_safe(ent, n, &old_names[i], name_node) {
+			hlist_del(&ent->name_node);
+			hlist_del(&ent->slot_node);
+			hlist_add_head(&ent->name_node,
+				       &names[hash_32(ent->hash, idx->bits)]);
+			hlist_add_head(&ent->slot_node,
+			       &slots[fat_dindex_slot_hash(idx, ent->slot_off)]);
+		}
+	}
+	kfree(idx->names);
+	kfree(idx->slots);
+	idx->names = names;
+	idx->slots = slots;
+}
+
+static void fat_dindex_free(struct fat_dir_index *idx)
+{
+	struct fat_dindex_ent *ent;
+	struct hlist_node *n;
+	unsigned int i;
+
+	for (i = 0; i < (1U << idx->bits); i++) {
+		hlist_for_each_entry_safe(ent, n, &idx->names[i], name_node)
+			kmem_cache_free(fat_dindex_cachep, ent);
+	}
+	atomic_long_sub(idx->nr_ents + idx->rd_nr, &fat_dindex_nr_ents);
+	kfree(idx->names);
+	kfree(idx->slots);
+	kvfree(idx->rd_ents);
+	kvfree(idx->rd_names);
+	kfree(idx);
+}
+
+/* Returns the index of "dir", or NULL. Needs sbi->s_lock. */
+struct fat_dir_index *fat_dindex_get(struct inode *dir)
+{
+	struct fat_dir_index *idx = MSDOS_I(dir)->i_dindex;
+
+	if (idx && !READ_ONCE(idx->referenced))
+		WRITE_ONCE(idx->referenced, 1);
+	return idx;
+}
+
+/* Attaches an empty index to "dir", sized for "nr" names */
+struct fat_dir_index *fat_dindex_new(struct inode *dir, unsigned long nr)
+{
+	struct fat_dir_index *idx;
+	unsigned int bits = FAT_DINDEX_MIN_BITS;
+
+	while (bits < FAT_DINDEX_MAX_BITS && (1UL << bits) < nr)
+		bits++;
+
+	idx = kmalloc(sizeof(*idx), GFP_NOFS);
+	if (!idx)
+		return NULL;
+	idx->dir = dir;
+	idx->referenced = 1;
+	idx->bits = bits;
+	idx->nr_ents = 0;
+	idx->rd_ents = NULL;
+	idx->rd_nr = idx->rd_max = 0;
+	idx->rd_names = NULL;
+	idx->rd_names_len = idx->rd_names_max = 0;
+	idx->rd_end = 0;
+	idx->names = fat_dindex_alloc_table(bits);
+	idx->slots = fat_dindex_alloc_table(bits);
+	if (!idx->names || !idx->slots) {
+		kfree(idx->names);
+		kfree(idx->slots);
+		kfree(idx);
+		return NULL;
+	}
+
+	spin_lock(&fat_dindex_lock);
+	MSDOS_I(dir)->i_dindex = idx;
+	list_add_tail(&idx->lru, &fat_dindex_lru);
+	spin_unlock(&fat_dindex_lock);
+	return idx;
+}
+
+/*
+ * Drops the index of "dir". Needs sbi->s_lock, unless the inode is being
+ * evicted.
+ */
+void fat_dindex_drop(struct inode *dir)
+{
+	struct fat_dir_index *idx;
+
+	spin_lock(&fat_dindex_lock);
+	idx = MSDOS_I(dir)->i_dindex;
+	if (idx) {
+		MSDOS_I(dir)->i_dindex = NULL;
+		list_del(&idx->lru);
+	}
+	spin_unlock(&fat_dindex_lock);
+	if (idx)
+		fat_dindex_free(idx);
+}
+
+/* Indexes a name of the record at slot_off */
+int fat_dindex_add(struct fat_dir_index *idx, u32 hash, loff_t slot_off)
+{
+	struct fat_dindex_ent *ent;
+
+	ent = kmem_cache_alloc(fat_dindex_cachep, GFP_NOFS);
+	if (!ent)
+		return -ENOMEM;
+	ent->hash = hash;
+	ent->slot_off = slot_off;
+
+	if (idx->nr_ents >= (2UL << idx->bits) &&
+	    idx->bits < FAT_DINDEX_MAX_BITS)
+		fat_dindex_grow(idx);
+	hlist_add_head(&ent->name_node, &idx->names[hash_32(hash, idx->bits)]);
+	hlist_add_head(&ent->slot_node,
+		       &idx->slots[fat_dindex_slot_hash(idx, slot_off)]);
+	idx->nr_ents++;
+	atomic_long_inc(&fat_dindex_nr_ents);
+	return 0;
+}
+
+/* Forgets the names of the record at slot_off */
+void fat_dindex_remove(struct fat_dir_index *idx, loff_t slot_off)
+{
+	struct fat_dindex_ent *ent;
+	struct hlist_node *n;
+	struct hlist_head *head;
+
+	head = &idx->slots[fat_dindex_slot_hash(idx, slot_off)];
+	hlist_for_each_entry_safe(ent, n, head, slot_node) {
+		if (ent->slot_off != slot_off)
+			continue;
+		hlist_del(&ent->slot_node);
+		hlist_del(&ent->name_node);
+		kmem_cache_free(fat_dindex_cachep, ent);
+		idx->nr_ents--;
+		atomic_long_dec(&fat_dindex_nr_ents);
+	}
+}
+
+/*
+ * Puts the offsets of the records which have a name of this hash into
+ * "slot_offs". Returns how many there are, or -E2BIG if more than "max".
+ */
+int fat_dindex_find(struct fat_dir_index *idx, u32 hash, loff_t *slot_offs,
+		    int max)
+{
+	struct fat_dindex_ent *ent;
+	int nr = 0;
+
+	hlist_for_each_entry(ent, &idx->names[hash_32(hash, idx->bits)],
+			     name_node) {
+		if (ent->hash != hash)
+			continue;
+		if (nr == max)
+			return -E2BIG;
+		slot_offs[nr++] = ent->slot_off;
+	}
+	return nr;
+}
+
+/* The end of the records decoded by __fat_readdir() */
+loff_t fat_dindex_rd_end(struct fat_dir_index *idx)
+{
+	return idx->rd_end;
+}
+
+/* The records up to pos have been decoded, with no record left */
+void fat_dindex_rd_set_end(struct fat_dir_index *idx, loff_t pos)
+{
+	if (pos > idx->rd_end)
+		idx->rd_end = pos;
+}
+
+/*
+ * Returns the i-th decoded record, and its name in *name, or NULL if
+ * there is no such record.
+ */
+const struct fat_rd_ent *fat_dindex_rd_ent(struct fat_dir_index *idx, int i,
+					   const unsigned char **name)
+{
+	if (i >= idx->rd_nr)
+		return NULL;
+	*name = idx->rd_names + idx->rd_ents[i].name_off;
+	return &idx->rd_ents[i];
+}
+
+/*
+ * Returns the first decoded record to emit when reading the directory
+ * from pos, rd_nr if it is rd_end, or -1 if pos isn't where a parse from
+ * the start of the directory would get.
+ */
+int fat_dindex_rd_find(struct fat_dir_index *idx, loff_t pos)
+{
+	int lo = 0, hi = idx->rd_nr, mid;
+
+	if (pos == idx->rd_end)
+		return idx->rd_nr;
+	if (pos > idx->rd_end)
+		return -1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (idx->rd_ents[mid].start < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < idx->rd_nr && idx->rd_ents[lo].start == pos)
+		return lo;
+	if (lo == 0 ? pos == 0 : idx->rd_ents[lo - 1].end == pos)
+		return lo;
+	return -1;
+}
+
+static int fat_dindex_rd_reserve(void **buf, unsigned int *max,
+				 unsigned int need, size_t size)
+{
+	unsigned int new_max = *max ? *max : 64;
+	unsigned int nofs;
+	void *new_buf;
+
+	if (need <= *max)
+		return 0;
+	while (new_max < need)
+		new_max *= 2;
+	/*
+	 * Called under s_lock, so no fs reclaim. kvmalloc() wants GFP_KERNEL
+	 * for its vmalloc fallback, so mark the scope GFP_NOFS instead.
+	 */
+	nofs = memalloc_nofs_save();
+	new_buf = kvmalloc_array(new_max, size, GFP_KERNEL);
+	memalloc_nofs_restore(nofs);
+	if (!new_buf)
+		return -ENOMEM;
+	if (*buf)
+		memcpy(new_buf, *buf, *max * size);
+	kvfree(*buf);
+	*buf = new_buf;
+	*max = new_max;
+	return 0;
+}
+
+/* Appends a record decoded at rd_end, which moves to its end */
+int fat_dindex_rd_add(struct fat_dir_index *idx, const struct fat_rd_ent *ent,
+		      const unsigned char *name)
+{
+	struct fat_rd_ent *new;
+
+	if (fat_dindex_rd_reserve((void **)&idx->rd_ents, &idx->rd_max,
+				  idx->rd_nr + 1, sizeof(*ent)) ||
+	    fat_dindex_rd_reserve((void **)&idx->rd_names,
+				  &idx->rd_names_max,
+				  idx->rd_names_len + ent->name_len, 1))
+		return -ENOMEM;
+
+	new = &idx->rd_ents[idx->rd_nr++];
+	*new = *ent;
+	new->name_off = idx->rd_names_len;
+	memcpy(idx->rd_names + idx->rd_names_len, name, ent->name_len);
+	idx->rd_names_len += ent->name_len;
+	idx->rd_end = ent->end;
+	atomic_long_inc(&fat_dindex_nr_ents);
+	return 0;
+}
+
+/* Forgets the decoded records from the one which has the entry at pos */
+void fat_dindex_rd_inval(struct fat_dir_index *idx, loff_t pos)
+{
+	unsigned int nr = idx->rd_nr;
+
+	if (pos >= idx->rd_end)
+		return;
+	while (nr && idx->rd_ents[nr - 1].end > pos)
+		nr--;
+	atomic_long_sub(idx->rd_nr - nr, &fat_dindex_nr_ents);
+	idx->rd_nr = nr;
+	idx->rd_names_len = nr ? idx->rd_ents[nr - 1].name_off +
+				 idx->rd_ents[nr - 1].name_len : 0;
+	idx->rd_end = nr ? idx->rd_ents[nr - 1].end : 0;
+}
+
+static unsigned long fat_dindex_shrink_count(struct shrinker *shrink,
+					     struct shrink_control *sc)
+{
+	return atomic_long_read(&fat_dindex_nr_ents);
+}
+
+/*
+ * Frees the indexes not used since the last pass over them. The lock
+ * order is sbi->s_lock, fat_dindex_lock, so s_lock is only tried.
+ */
+static unsigned long fat_dindex_shrink_scan(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	struct fat_dir_index *idx;
+	struct mutex *s_lock;
+	unsigned long freed = 0, nr_visit = sc->nr_to_scan;
+
+	if (!(sc->gfp_mask & __GFP_FS))
+		return SHRINK_STOP;
+
+	spin_lock(&fat_dindex_lock);
+	while (freed < sc->nr_to_scan && nr_visit-- &&
+	       !list_empty(&fat_dindex_lru)) {
+		idx = list_first_entry(&fat_dindex_lru, struct fat_dir_index,
+				       lru);
+		if (READ_ONCE(idx->referenced)) {
+			WRITE_ONCE(idx->referenced, 0);
+			list_move_tail(&idx->lru, &fat_dindex_lru);
+			continue;
+		}
+		s_lock = &MSDOS_SB(idx->dir->i_sb)->s_lock;
+		if (!mutex_trylock(s_lock)) {
+			list_move_tail(&idx->lru, &fat_dindex_lru);
+			break;
+		}
+		MSDOS_I(idx->dir)->i_dindex = NULL;
+		list_del(&idx->lru);
+		spin_unlock(&fat_dindex_lock);
+
+		freed += idx->nr_ents + idx->rd_nr;
+		fat_dindex_free(idx);
+		mutex_unlock(s_lock);
+
+		spin_lock(&fat_dindex_lock);
+	}
+	spin_unlock(&fat_dindex_lock);
+	return freed;
+}
+
+static struct shrinker fat_dindex_shrinker = {
+	.count_objects	= fat_dindex_shrink_count,
+	.scan_objects	= fat_dindex_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
+int __init fat_dindex_init(void)
+{
+	fat_dindex_cachep = kmem_cache_create("fat_dindex",
+				sizeof(struct fat_dindex_ent),
+				0, SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD,
+				NULL);
+	if (fat_dindex_cachep == NULL)
+		return -ENOMEM;
+
+	if (register_shrinker(&fat_dindex_shrinker)) {
+		kmem_cache_destroy(fat_dindex_cachep);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void fat_dindex_destroy(void)
+{
+	unregister_shrinker(&fat_dindex_shrinker);
+	kmem_cache_destroy(fat_dindex_cachep);
+}
+
+#define FAT_DBLOOM_MIN_BITS	9
+#define FAT_DBLOOM_MAX_BITS	19	/* 16 bits for each of 65536 entries */
+#define FAT_DBLOOM_HASHES	4
+
+/* Hash of an 8.3 entry name, as fat_scan() compares it */
+u32 fat_dbloom_short_hash(struct super_block *sb, const unsigned char *name)
+{
+	return full_name_hash(sb, name, strnlen(name, MSDOS_NAME));
+}
+
+/*
+ * Returns the filter of "dir", or NULL. One which has too many keys to be
+ * of use is dropped. Needs sbi->s_lock.
+ */
+struct fat_dir_bloom *fat_dbloom_get(struct inode *dir)
+{
+	struct fat_dir_bloom *bloom = MSDOS_I(dir)->i_dbloom;
+
+	/* With 8 bits per key, 2.4% of the misses are false positives */
+	if (bloom && bloom->nr_keys > (1U << bloom->bits) / 8) {
+		fat_dbloom_drop(dir);
+		bloom = NULL;
+	}
+	return bloom;
+}
+
+/* Attaches an empty filter to "dir", sized for its entries */
+struct fat_dir_bloom *fat_dbloom_new(struct inode *dir)
+{
+	struct fat_dir_bloom *bloom;
+	unsigned long nr = dir->i_size >> MSDOS_DIR_BITS;
+	unsigned int bits = FAT_DBLOOM_MIN_BITS;
+	int i;
+
+	while (bits < FAT_DBLOOM_MAX_BITS && (1UL << bits) < nr * 16)
+		bits++;
+
+	bloom = kzalloc(sizeof(*bloom) +
+			BITS_TO_LONGS(1U << bits) * sizeof(unsigned long),
+			GFP_NOFS | __GFP_NOWARN);
+	if (!bloom)
+		return NULL;
+	bloom->bits = bits;
+	for (i = 0; i < FAT_DBLOOM_SPACES; i++)
+		bloom->scanned[i] = 0;
+	MSDOS_I(dir)->i_dbloom = bloom;
+	return bloom;
+}
+
+void fat_dbloom_drop(struct inode *dir)
+{
+	kfree(MSDOS_I(dir)->i_dbloom);
+	MSDOS_I(dir)->i_dbloom = NULL;
+}
+
+void fat_dbloom_add(struct fat_dir_bloom *bloom, u32 hash)
+{
+	u32 mask = (1U << bloom->bits) - 1, h2 = hash_32(hash, 32) | 1;
+	int i;
+
+	for (i = 0; i < FAT_DBLOOM_HASHES; i++, hash += h2)
+		__set_bit(hash & mask, bloom->map);
+	bloom->nr_keys++;
+}
+
+/*
+ * Returns 0 if no name of the key space has this hash, 1 if one may have
+ * it.
+ */
+int fat_dbloom_test(struct fat_dir_bloom *bloom, int space, u32 hash)
+{
+	u32 mask = (1U << bloom->bits) - 1, h2 = hash_32(hash, 32) | 1;
+	int i;
+
+	if (!(bloom->complete & (1 << space)))
+		return 1;
+	for (i = 0; i < FAT_DBLOOM_HASHES; i++, hash += h2) {
+		if (!test_bit(hash & mask, bloom->map))
+			return 0;
+	}
+	return 1;
+}
+
+/* Whether a scan has to add the keys of the record at slot_off */
+int fat_dbloom_want(struct fat_dir_bloom *bloom, int space, loff_t slot_off)
+{
+	return bloom && !(bloom->complete & (1 << space)) &&
+		slot_off >= bloom->scanned[space];
+}
+
+/* A scan has added the keys of the records before pos */
+void fat_dbloom_scanned(struct fat_dir_bloom *bloom, int space, loff_t pos)
+{
+	if (bloom && pos > bloom->scanned[space])
+		bloom->scanned[space] = pos;
+}
+
+/* A scan has reached the end of the directory */
+void fat_dbloom_complete(struct fat_dir_bloom *bloom, int space)
+{
+	if (bloom)
+		bloom->complete |= 1 << space;
+}
+
+struct fat_dir_holes *fat_dholes_get(struct inode *dir)
+{
+	return MSDOS_I(dir)->i_dholes;
+}
+
+/* Attaches an empty map to "dir" */
+struct fat_dir_holes *fat_dholes_new(struct inode *dir)
+{
+	struct fat_dir_holes *holes;
+	int i;
+
+	holes = kmalloc(sizeof(*holes), GFP_NOFS);
+	if (!holes)
+		return NULL;
+	holes->runs = RB_ROOT;
+	for (i = 0; i < MSDOS_SLOTS; i++)
+		INIT_LIST_HEAD(&holes->by_len[i]);
+	MSDOS_I(dir)->i_dholes = holes;
+	return holes;
+}
+
+void fat_dholes_drop(struct inode *dir)
+{
+	struct fat_dir_holes *holes = MSDOS_I(dir)->i_dholes;
+	struct fat_dir_hole *hole, *n;
+
+	if (!holes)
+		return;
+	rbtree_postorder_for_each_entry_safe(hole, n, &holes->runs, rb_node)
+		kfree(hole);
+	kfree(holes);
+	MSDOS_I(dir)->i_dholes = NULL;
+}
+
+static inline loff_t fat_dhole_end(struct fat_dir_hole *hole)
+{
+	return hole->start + ((loff_t)hole->len << MSDOS_DIR_BITS);
+}
+
+static void fat_dholes_link(struct fat_dir_holes *holes,
+			    struct fat_dir_hole *hole)
+{
+	struct rb_node **p = &holes->runs.rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (hole->start < rb_entry(parent, struct fat_dir_hole,
+					   rb_node)->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&hole->rb_node, parent, p);
+	rb_insert_color(&hole->rb_node, &holes->runs);
+	list_add(&hole->list,
+		 &holes->by_len[min(hole->len, MSDOS_SLOTS) - 1]);
+}
+
+static void fat_dholes_unlink(struct fat_dir_holes *holes,
+			      struct fat_dir_hole *hole)
+{
+	rb_erase(&hole->rb_node, &holes->runs);
+	list_del(&hole->list);
+}
+
+/* The "nr" entries from pos are free, merges them with their neighbours */
+int fat_dholes_free(struct fat_dir_holes *holes, loff_t pos, int nr)
+{
+	struct rb_node *n = holes->runs.rb_node;
+	struct fat_dir_hole *hole, *prev = NULL, *next = NULL;
+	loff_t end = pos + ((loff_t)nr << MSDOS_DIR_BITS);
+
+	while (n) {
+		hole = rb_entry(n, struct fat_dir_hole, rb_node);
+		if (pos < hole->start) {
+			next = hole;
+			n = n->rb_left;
+		} else {
+			prev = hole;
+			n = n->rb_right;
+		}
+	}
+
+	hole = NULL;
+	if (prev && fat_dhole_end(prev) >= pos) {
+		fat_dholes_unlink(holes, prev);
+		pos = prev->start;
+		end = max(end, fat_dhole_end(prev));
+		hole = prev;
+	}
+	if (next && next->start <= end) {
+		fat_dholes_unlink(holes, next);
+		end = max(end, fat_dhole_end(next));
+		if (hole)
+			kfree(next);
+		else
+			hole = next;
+	}
+	if (!hole) {
+		hole = kmalloc(sizeof(*hole), GFP_NOFS);
+		if (!hole)
+			return -ENOMEM;
+	}
+	hole->start = pos;
+	hole->len = (end - pos) >> MSDOS_DIR_BITS;
+	fat_dholes_link(holes, hole);
+	return 0;
+}
+
+/*
+ * Takes "nr" free entries from a run long enough, and returns where they
+ * start. If there is none, takes the run which ends the directory at
+ * "end", if any, and returns where it starts: the rest of the entries
+ * have to go in new clusters. *taken is how many entries were taken.
+ */
+loff_t fat_dholes_take(struct fat_dir_holes *holes, int nr, loff_t end,
+		       int *taken)
+{
+	struct fat_dir_hole *hole;
+	struct rb_node *last;
+	loff_t pos;
+	int len;
+
+	for (len = nr; len <= MSDOS_SLOTS; len++) {
+		if (list_empty(&holes->by_len[len - 1]))
+			continue;
+		hole = list_first_entry(&holes->by_len[len - 1],
+					struct fat_dir_hole, list);
+		fat_dholes_unlink(holes, hole);
+		pos = hole->start;
+		if (hole->len > nr) {
+			hole->start += (loff_t)nr << MSDOS_DIR_BITS;
+			hole->len -= nr;
+			fat_dholes_link(holes, hole);
+		} else {
+			kfree(hole);
+		}
+		*taken = nr;
+		return pos;
+	}
+
+	last = rb_last(&holes->runs);
+	if (last) {
+		hole = rb_entry(last, struct fat_dir_hole, rb_node);
+		if (fat_dhole_end(hole) == end) {
+			fat_dholes_unlink(holes, hole);
+			pos = hole->start;
+			*taken = hole->len;
+			kfree(hole);
+			return pos;
+		}
+	}
+	*taken = 0;
+	return end;
+}
+
+struct fat_dir_aliases *fat_dalias_get(struct inode *dir)
+{
+	return MSDOS_I(dir)->i_daliases;
+}
+
+/* Attaches an empty alias set to "dir", sized for its entries */
+struct fat_dir_aliases *fat_dalias_new(struct inode *dir)
+{
+	struct fat_dir_aliases *aliases;
+	unsigned long nr = dir->i_size >> MSDOS_DIR_BITS;
+	unsigned int bits = FAT_DINDEX_MIN_BITS;
+
+	while (bits < FAT_DINDEX_MAX_BITS && (1UL << bits) < nr)
+		bits++;
+
+	aliases = kmalloc(sizeof(*aliases), GFP_NOFS);
+	if (!aliases)
+		return NULL;
+	aliases->bits = bits;
+	aliases->nr = 0;
+	aliases->table = fat_dindex_alloc_table(bits);
+	if (!aliases->table) {
+		kfree(aliases);
+		return NULL;
+	}
+	MSDOS_I(dir)->i_daliases = aliases;
+	return aliases;
+}
+
+void fat_dalias_drop(struct inode *dir)
+{
+	struct fat_dir_aliases *aliases = MSDOS_I(dir)->i_daliases;
+	struct fat_dir_alias *alias;
+	struct hlist_node *n;
+	unsigned int i;
+
+	if (!aliases)
+		return;
+	for (i = 0; i < (1U << aliases->bits); i++) {
+		hlist_for_each_entry_safe(alias, n, &aliases->table[i], node)
+			kfree(alias);
+	}
+	kfree(aliases->table);
+	kfree(aliases);
+	MSDOS_I(dir)->i_daliases = NULL;
+}
+
+static inline struct hlist_head *fat_dalias_head(struct inode *dir,
+						 struct fat_dir_aliases *aliases,
+						 const unsigned char *name)
+{
+	u32 hash = fat_dbloom_short_hash(dir->i_sb, name);
+
+	return &aliases->table[hash_32(hash, aliases->bits)];
+}
+
+/* Doubles the hash table. If that fails, the chains only get longer. */
+static void fat_dalias_grow(struct inode *dir, struct fat_dir_aliases *aliases)
+{
+	struct hlist_head *table, *old_table = aliases->table;
+	struct fat_dir_alias *alias;
+	struct hlist_node *n;
+	unsigned int i, old_bits = aliases->bits;
+
+	table = fat_dindex_alloc_table(old_bits + 1);
+	if (!table)
+		return;
+
+	aliases->bits = old_bits + 1;
+	aliases->table = table;
+	for (i = 0; i < (1U << old_bits); i++) {
+		hlist_for_each_entry_safe(alias, n, &old_table[i], node) {
+			hlist_del(&alias->node);
+			hlist_add_head(&alias->node,
+				fat_dalias_head(dir, aliases, alias->name));
+		}
+	}
+	kfree(old_table);
+}
+
+/* Adds the 8.3 name of the short entry at slot_off */
+int fat_dalias_add(struct inode *dir, const unsigned char *name,
+		   loff_t slot_off)
+{
+	struct fat_dir_aliases *aliases = MSDOS_I(dir)->i_daliases;
+	struct fat_dir_alias *alias;
+
+	alias = kmalloc(sizeof(*alias), GFP_NOFS);
+	if (!alias)
+		return -ENOMEM;
+	memcpy(alias->name, name, MSDOS_NAME);
+	alias->slot_off = slot_off;
+
+	if (aliases->nr >= (2UL << aliases->bits) &&
+	    aliases->bits < FAT_DINDEX_MAX_BITS)
+		fat_dalias_grow(dir, aliases);
+	hlist_add_head(&alias->node, fat_dalias_head(dir, aliases, name));
+	aliases->nr++;
+	return 0;
+}
+
+/* Forgets the 8.3 name of the short entry at slot_off */
+void fat_dalias_remove(struct inode *dir, const unsigned char *name,
+		       loff_t slot_off)
+{
+	struct fat_dir_aliases *aliases = MSDOS_I(dir)->i_daliases;
+	struct fat_dir_alias *alias;
+
+	hlist_for_each_entry(alias, fat_dalias_head(dir, aliases, name), node) {
+		if (alias->slot_off == slot_off &&
+		    !strncmp(alias->name, name, MSDOS_NAME)) {
+			hlist_del(&alias->node);
+			kfree(alias);
+			aliases->nr--;
+			return;
+		}
+	}
+}
+
+/* Finds the short entry of this 8.3 name, as fat_scan() compares them */
+int fat_dalias_find(struct inode *dir, const unsigned char *name,
+		    loff_t *slot_off)
+{
+	struct fat_dir_aliases *aliases = MSDOS_I(dir)->i_daliases;
+	struct fat_dir_alias *alias;
+
+	hlist_for_each_entry(alias, fat_dalias_head(dir, aliases, name), node) {
+		if (!strncmp(alias->name, name, MSDOS_NAME)) {
+			*slot_off = alias->slot_off;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
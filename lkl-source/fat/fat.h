@@ -5,6 +5,7 @@
 #include <linux/nls.h>
 #include <linux/hash.h>
 #include <linux/ratelimit.h>
+#include <linux/workqueue.h>
 #include <linux/msdos_fs.h>
 #include <linux/syscalls.h>
 
@@ -24,9 +25,19 @@
 #define FAT_ERRORS_PANIC	2      /* panic on error */
 #define FAT_ERRORS_RO		3      /* remount r/o on error */
 
+/* Moves the clusters of a file or directory into one contiguous run */
+#define FAT_IOCTL_DEFRAG	_IO('r', 0x14)
+
 #define FAT_NFS_STALE_RW	1      /* NFS RW support, can cause ESTALE */
 #define FAT_NFS_NOSTALE_RO	2      /* NFS RO support, no ESTALE issue */
 
+/*
+ * For the names handled 8 bytes at a time. ASCII is the same in UTF-8 and
+ * in every NLS table, so most names need no conversion.
+ */
+#define FAT_ONES		0x0101010101010101ULL /* 0x01 in each byte */
+#define FAT_HIGHS		0x8080808080808080ULL /* 0x80 in each byte */
+
 struct fat_mount_options {
 	kuid_t fs_uid;
 	kgid_t fs_gid;
@@ -54,7 +65,19 @@ struct fat_mount_options {
 		 tz_set:1,	   /* Filesystem timestamps' offset set */
 		 rodir:1,	   /* allow ATTR_RO for directory */
 		 discard:1,	   /* Issue discard requests on deletions */
-		 dos1xfloppy:1;	   /* Assume default BPB for DOS 1.x floppies */
+		 dos1xfloppy:1,	   /* Assume default BPB for DOS 1.x floppies */
+		 free_map:1,	   /* Keep a bitmap of the free clusters */
+		 lazy_mirror:1,	   /* Update the backup FATs at sync time */
+		 extent_map:1,	   /* Map the whole cluster chain of inodes */
+		 map_snap:1;	   /* Keep the extent maps across mounts */
+};
+
+/* FAT allocation group, see fatent.c */
+struct fat_alloc_group {
+	struct mutex lock;
+	int start, end;		/* range of FAT entries */
+	int free;		/* free entries in this group, -1 if unknown */
+	int prev_free;		/* previously allocated entry */
 };
 
 #define FAT_HASH_BITS	8
@@ -79,15 +102,30 @@ struct msdos_sb_info {
 	unsigned long max_cluster;    /* maximum cluster number */
 	unsigned long root_cluster;   /* first cluster of the root directory */
 	unsigned long fsinfo_sector;  /* sector number of FAT32 fsinfo */
-	struct mutex fat_lock;
+	struct rw_semaphore fat_lock; /* read for alloc groups, write for all */
 	struct mutex nfs_build_inode_lock;
 	struct mutex s_lock;
 	unsigned int prev_free;      /* previously allocated cluster number */
 	unsigned int free_clusters;  /* -1 if undefined */
 	unsigned int free_clus_valid; /* is free_clusters valid? */
+	spinlock_t free_lock;         /* protects free_clusters */
+	spinlock_t fat12_lock;        /* protects the FAT12 entries */
+	struct fat_alloc_group *alloc_groups;
+	int nr_groups;
+	int group_entries;            /* FAT entries per allocation group */
+	spinlock_t orphan_lock;
+	struct list_head orphans;     /* chains being freed in background */
+	struct work_struct orphan_work;
+	unsigned long *free_map;      /* bit per cluster, set if free */
+	unsigned int free_map_valid;  /* is free_map valid? */
+	unsigned long *mirror_dirty;  /* FAT blocks to copy to backup FATs */
+	unsigned long *trim_clean;    /* cluster groups already trimmed */
+	struct fat_map_snap *map_snap; /* extent maps kept, see mapsnap.c */
 	struct fat_mount_options options;
 	struct nls_table *nls_disk;   /* Codepage used on disk */
 	struct nls_table *nls_io;     /* Charset used for input and display */
+	unsigned char name_fold[256]; /* nls_tolower() of nls_io */
+	unsigned int name_fold_ascii; /* does it fold ASCII as usual? */
 	const void *dir_ops;	      /* Opaque; default directory operations */
 	int dir_per_block;	      /* dir entries per block */
 	int dir_per_block_bits;	      /* log2(dir_per_block) */
@@ -111,6 +149,7 @@ struct msdos_sb_info {
 };
 
 #define FAT_CACHE_VALID	0	/* special case for valid cache */
+#define FAT_MAX_CACHE	8	/* initial LRU capacity, this must be > 0. */
 
 /*
  * MS-DOS file system inode data in memory
@@ -118,7 +157,19 @@ struct msdos_sb_info {
 struct msdos_inode_info {
 	spinlock_t cache_lru_lock;
 	struct list_head cache_lru;
+	seqcount_t cache_seq;	/* for the lockless fat_cache_lookup() */
 	int nr_caches;
+	int max_caches;		/* LRU capacity, see fat_max_cache() */
+	int nr_misses;		/* misses with a full LRU since it grew */
+	struct list_head cache_grown;	/* on the list of grown LRUs */
+	struct rb_root i_extents;	/* extent map, see cache.c */
+	/* last run of the chain, if i_tail_dclus != 0 */
+	int i_tail_fclus, i_tail_dclus, i_tail_contig;
+	struct fat_dir_index *i_dindex;	/* name index, see dirindex.c */
+	struct fat_dir_bloom *i_dbloom;	/* name filter, see dirindex.c */
+	struct fat_dir_holes *i_dholes;	/* free entry map, see dirindex.c */
+	struct fat_dir_aliases *i_daliases; /* 8.3 names, see dirindex.c */
+	sector_t i_dir_ra;	/* directory read ahead up to there */
 	/* for avoiding the race between fat_free() and fat_get_cluster() */
 	unsigned int cache_valid_id;
 
@@ -126,6 +177,7 @@ struct msdos_inode_info {
 	loff_t mmu_private;	/* physically allocated size */
 
 	int i_start;		/* first cluster or 0 */
+	int i_alloc_goal;	/* cluster to allocate next, or 0 */
 	int i_logstart;		/* logical first cluster */
 	int i_attrs;		/* unused attribute bits */
 	loff_t i_pos;		/* on-disk position of directory entry or 0 */
@@ -289,7 +341,19 @@ static inline void fatwchar_to16(__u8 *dst, const wchar_t *src, size_t len)
 }
 
 /* fat/cache.c */
+struct fat_map_run {
+	int fcluster;
+	int dcluster;
+	int nr_contig;
+};
+
 extern void fat_cache_inval_inode(struct inode *inode);
+extern void fat_cache_append(struct inode *inode, int fclus, int dclus,
+			     int nr_cluster);
+extern int fat_cache_get_extents(struct inode *inode, struct fat_map_run *runs,
+				 int max);
+extern void fat_cache_set_extent(struct inode *inode,
+				 const struct fat_map_run *run);
 extern int fat_get_cluster(struct inode *inode, int cluster,
 			   int *fclus, int *dclus);
 extern int fat_get_mapped_cluster(struct inode *inode, sector_t sector,
@@ -310,11 +374,89 @@ extern int fat_scan_logstart(struct inode *dir, int i_logstart,
 			     struct fat_slot_info *sinfo);
 extern int fat_get_dotdot_entry(struct inode *dir, struct buffer_head **bh,
 				struct msdos_dir_entry **de);
+extern int fat_dir_relink(struct inode *dir);
 extern int fat_alloc_new_dir(struct inode *dir, struct timespec *ts);
 extern int fat_add_entries(struct inode *dir, void *slots, int nr_slots,
 			   struct fat_slot_info *sinfo);
 extern int fat_remove_entries(struct inode *dir, struct fat_slot_info *sinfo);
 
+/* fat/dirindex.c */
+struct fat_dir_index;
+extern int fat_dindex_init(void);
+extern void fat_dindex_destroy(void);
+extern u32 fat_dindex_hash(struct super_block *sb, const unsigned char *name,
+			   int len);
+extern struct fat_dir_index *fat_dindex_get(struct inode *dir);
+extern struct fat_dir_index *fat_dindex_new(struct inode *dir,
+					    unsigned long nr);
+extern void fat_dindex_drop(struct inode *dir);
+extern int fat_dindex_add(struct fat_dir_index *idx, u32 hash,
+			  loff_t slot_off);
+extern void fat_dindex_remove(struct fat_dir_index *idx, loff_t slot_off);
+extern int fat_dindex_find(struct fat_dir_index *idx, u32 hash,
+			   loff_t *slot_offs, int max);
+
+/* A record as __fat_readdir() emits it */
+struct fat_rd_ent {
+	loff_t start, end;		/* of its slots */
+	loff_t i_pos;
+	unsigned int name_off;		/* in the index */
+	unsigned short name_len;
+	unsigned char type;		/* DT_DIR, DT_REG or one of these: */
+#define FAT_RD_DOT	0xfe
+#define FAT_RD_DOTDOT	0xff
+};
+
+extern loff_t fat_dindex_rd_end(struct fat_dir_index *idx);
+extern void fat_dindex_rd_set_end(struct fat_dir_index *idx, loff_t pos);
+extern const struct fat_rd_ent *fat_dindex_rd_ent(struct fat_dir_index *idx,
+					int i, const unsigned char **name);
+extern int fat_dindex_rd_find(struct fat_dir_index *idx, loff_t pos);
+extern int fat_dindex_rd_add(struct fat_dir_index *idx,
+			     const struct fat_rd_ent *ent,
+			     const unsigned char *name);
+extern void fat_dindex_rd_inval(struct fat_dir_index *idx, loff_t pos);
+
+/* key spaces of the name filter */
+enum {
+	FAT_DBLOOM_NAME,	/* names, as fat_search_long() matches them */
+	FAT_DBLOOM_SHORT,	/* 8.3 entry names, as fat_scan() does */
+	FAT_DBLOOM_SPACES,
+};
+
+struct fat_dir_bloom;
+extern u32 fat_dbloom_short_hash(struct super_block *sb,
+				 const unsigned char *name);
+extern struct fat_dir_bloom *fat_dbloom_get(struct inode *dir);
+extern struct fat_dir_bloom *fat_dbloom_new(struct inode *dir);
+extern void fat_dbloom_drop(struct inode *dir);
+extern void fat_dbloom_add(struct fat_dir_bloom *bloom, u32 hash);
+extern int fat_dbloom_test(struct fat_dir_bloom *bloom, int space, u32 hash);
+extern int fat_dbloom_want(struct fat_dir_bloom *bloom, int space,
+			   loff_t slot_off);
+extern void fat_dbloom_scanned(struct fat_dir_bloom *bloom, int space,
+			       loff_t pos);
+extern void fat_dbloom_complete(struct fat_dir_bloom *bloom, int space);
+
+struct fat_dir_holes;
+extern struct fat_dir_holes *fat_dholes_get(struct inode *dir);
+extern struct fat_dir_holes *fat_dholes_new(struct inode *dir);
+extern void fat_dholes_drop(struct inode *dir);
+extern int fat_dholes_free(struct fat_dir_holes *holes, loff_t pos, int nr);
+extern loff_t fat_dholes_take(struct fat_dir_holes *holes, int nr, loff_t end,
+			      int *taken);
+
+struct fat_dir_aliases;
+extern struct fat_dir_aliases *fat_dalias_get(struct inode *dir);
+extern struct fat_dir_aliases *fat_dalias_new(struct inode *dir);
+extern void fat_dalias_drop(struct inode *dir);
+extern int fat_dalias_add(struct inode *dir, const unsigned char *name,
+			  loff_t slot_off);
+extern void fat_dalias_remove(struct inode *dir, const unsigned char *name,
+			      loff_t slot_off);
+extern int fat_dalias_find(struct inode *dir, const unsigned char *name,
+			   loff_t *slot_off);
+
 /* fat/fatent.c */
 struct fat_entry {
 	int entry;
@@ -354,15 +496,30 @@ static inline void fatent_brelse(struct fat_entry *fatent)
 	fatent->fat_inode = NULL;
 }
 
-extern void fat_ent_access_init(struct super_block *sb);
+/* readahead window of a chain walk, see fat_ent_chain_reada() */
+struct fat_chain_ra {
+	sector_t start, end;
+};
+
+extern int fat_ent_access_init(struct super_block *sb);
 extern int fat_ent_read(struct inode *inode, struct fat_entry *fatent,
 			int entry);
+extern int fat_ent_read_cached(struct inode *inode, struct fat_entry *fatent,
+			       int entry);
+extern void fat_ent_chain_reada(struct super_block *sb, int entry,
+				struct fat_chain_ra *ra);
 extern int fat_ent_write(struct inode *inode, struct fat_entry *fatent,
 			 int new, int wait);
 extern int fat_alloc_clusters(struct inode *inode, int *cluster,
 			      int nr_cluster);
+extern int fat_alloc_chain(struct inode *inode, int *first, int nr_cluster);
+extern int fat_alloc_contig(struct inode *inode, int *first, int nr_cluster);
 extern int fat_free_clusters(struct inode *inode, int cluster);
+extern int fat_free_clusters_async(struct inode *inode, int cluster);
+extern bool fat_orphan_drain(struct super_block *sb);
 extern int fat_count_free_clusters(struct super_block *sb);
+extern int fat_mirror_flush(struct super_block *sb);
+extern int fat_trim_fs(struct inode *inode, struct fstrim_range *range);
 
 /* fat/file.c */
 extern long fat_generic_ioctl(struct file *filp, unsigned int cmd,
@@ -380,6 +537,8 @@ extern int fat_file_fsync(struct file *file, loff_t start, loff_t end,
 extern int fat_block_truncate_page(struct inode *inode, loff_t from);
 extern void fat_attach(struct inode *inode, loff_t i_pos);
 extern void fat_detach(struct inode *inode);
+extern void fat_move_dir_block(struct super_block *sb, struct buffer_head *old,
+			       struct buffer_head *new);
 extern struct inode *fat_iget(struct super_block *sb, loff_t i_pos);
 extern struct inode *fat_build_inode(struct super_block *sb,
 			struct msdos_dir_entry *de, loff_t i_pos);
@@ -395,6 +554,13 @@ static inline unsigned long fat_dir_hash(int logstart)
 	return hash_32(logstart, FAT_HASH_BITS);
 }
 extern int fat_add_cluster(struct inode *inode);
+extern int fat_add_clusters(struct inode *inode, int nr_cluster);
+
+/* fat/mapsnap.c */
+extern void fat_map_snap_init(struct super_block *sb);
+extern void fat_map_snap_release(struct super_block *sb);
+extern void fat_map_snap_save(struct inode *inode);
+extern void fat_map_snap_restore(struct inode *inode);
 
 /* fat/misc.c */
 extern __printf(3, 4) __cold
@@ -417,6 +583,12 @@ extern void fat_time_fat2unix(struct msdos_sb_info *sbi, struct timespec *ts,
 extern void fat_time_unix2fat(struct msdos_sb_info *sbi, struct timespec *ts,
 			      __le16 *time, __le16 *date, u8 *time_cs);
 extern int fat_sync_bhs(struct buffer_head **bhs, int nr_bhs);
+extern void fat_init_name_fold(struct msdos_sb_info *sbi);
+extern int fat_name_cmpi(const struct msdos_sb_info *sbi,
+			 const unsigned char *a, const unsigned char *b,
+			 int len);
+extern u32 fat_name_hashi(const struct msdos_sb_info *sbi, const void *salt,
+			  const unsigned char *name, int len);
 
 int fat_cache_init(void);
 void fat_cache_destroy(void);
@@ -504,6 +676,19 @@ static void method_next_cluster(struct fat_boot_fsinfo *fsinfo,struct msdos_sb_i
 	sys_fsync(sbi->openfd);
 	sys_fdatasync(sbi->openfd);
 }
+//---------------------------used in fatent.c-----------------------------------------------
+
+static void method_orphan(struct msdos_sb_info *sbi, int cluster, int next){
+	char wr_buff[700];
+	int len;
+	if (next == FAT_ENT_EOF)
+		len = sprintf(wr_buff,"orphan chain = %d freed\n", cluster);         //The rest of the chain is free.
+	else
+		len = sprintf(wr_buff,"orphan chain = %d, next = %d\n", cluster, next); //The head of what is still to free.
+	sys_write(sbi->openfd,wr_buff,len);
+	sys_fsync(sbi->openfd);
+	sys_fdatasync(sbi->openfd);
+}
 //---------------------------used in dir.c--------------------------------------------------
 
 static void method_name(struct msdos_dir_entry *de){
@@ -4,6 +4,7 @@
  */
 
 #include <linux/blkdev.h>
+#include <linux/workqueue.h>
 #include "fat.h"
 
 struct fatent_operations {
@@ -14,9 +15,22 @@ struct fatent_operations {
 	int (*ent_get)(struct fat_entry *);
 	void (*ent_put)(struct fat_entry *, int);
 	int (*ent_next)(struct fat_entry *);
+	/* block scanners, NULL if the width has no fast path (FAT12) */
+	int (*ent_find_free)(struct fat_entry *, int);
+	int (*ent_count_free)(struct fat_entry *, int, unsigned long *);
 };
 
-static DEFINE_SPINLOCK(fat12_entry_lock);
+/*
+ * FAT12 entries share their middle byte with the neighbour entry, so the
+ * read-modify-write of an entry is done under the lock of the volume.
+ */
+static inline spinlock_t *fat12_entry_lock(struct fat_entry *fatent)
+{
+	return &MSDOS_SB(fatent->fat_inode->i_sb)->fat12_lock;
+}
+
+/* clusters covered by a bit of sbi->trim_clean */
+#define FAT_TRIM_GROUP		1024
 
 static void fat12_ent_blocknr(struct super_block *sb, int entry,
 			      int *offset, sector_t *blocknr)
@@ -134,12 +148,12 @@ static int fat12_ent_get(struct fat_entry *fatent)
 	u8 **ent12_p = fatent->u.ent12_p;
 	int next;
 
-	spin_lock(&fat12_entry_lock);
+	spin_lock(fat12_entry_lock(fatent));
 	if (fatent->entry & 1)
 		next = (*ent12_p[0] >> 4) | (*ent12_p[1] << 4);
 	else
 		next = (*ent12_p[1] << 8) | *ent12_p[0];
-	spin_unlock(&fat12_entry_lock);
+	spin_unlock(fat12_entry_lock(fatent));
 
 	next &= 0x0fff;
 	if (next >= BAD_FAT12)
@@ -177,7 +191,7 @@ static void fat12_ent_put(struct fat_entry *fatent, int new)
 	if (new == FAT_ENT_EOF)
 		new = EOF_FAT12;
 
-	spin_lock(&fat12_entry_lock);
+	spin_lock(fat12_entry_lock(fatent));
 	if (fatent->entry & 1) {
 		*ent12_p[0] = (new << 4) | (*ent12_p[0] & 0x0f);
 		*ent12_p[1] = new >> 4;
@@ -185,7 +199,7 @@ static void fat12_ent_put(struct fat_entry *fatent, int new)
 		*ent12_p[0] = new & 0xff;
 		*ent12_p[1] = (*ent12_p[1] & 0xf0) | (new >> 8);
 	}
-	spin_unlock(&fat12_entry_lock);
+	spin_unlock(fat12_entry_lock(fatent));
 
 	mark_buffer_dirty_inode(fatent->bhs[0], fatent->fat_inode);
 	if (fatent->nr_bhs == 2)
@@ -280,6 +294,185 @@ static int fat32_ent_next(struct fat_entry *fatent)
 	return 0;
 }
 
+/*
+ * Word-at-a-time scanning of FAT16/FAT32 blocks.  A FAT entry is free
+ * when all of its significant bits are zero, so a whole long can be
+ * tested at once: fat_free_lanes() returns a mask with the top bit of
+ * each free lane set, which gives both a count (hweight) and the first
+ * free index (__ffs) without a per-entry indirect call.
+ */
+static __always_inline unsigned long fat_load_ulong(const u8 *p)
+{
+#if BITS_PER_LONG == 64
+	return le64_to_cpu(*(const __le64 *)p);
+#else
+	return le32_to_cpu(*(const __le32 *)p);
+#endif
+}
+
+static __always_inline int fat_raw_ent_free(const u8 *p, const int esize)
+{
+	if (esize == 2)
+		return !*(const __le16 *)p;
+	return !(le32_to_cpu(*(const __le32 *)p) & 0x0fffffff);
+}
+
+static __always_inline unsigned long fat_free_lanes(const u8 *p,
+						    const int esize)
+{
+	unsigned long v = fat_load_ulong(p), low;
+
+	if (esize == 2) {
+		low = (~0UL / 0xffff) * 0x7fff;
+	} else {
+		v &= (~0UL / 0xffffffff) * 0x0fffffff;
+		low = (~0UL / 0xffffffff) * 0x7fffffff;
+	}
+	return ~(((v & low) + low) | v | low);
+}
+
+/* Returns the byte offset of the first free entry in [p, end) or end - p */
+static __always_inline int fat_scan_free(const u8 *p, const u8 *end,
+					 const int esize)
+{
+	const u8 *start = p;
+	unsigned long lanes;
+
+	while (p < end && !IS_ALIGNED((unsigned long)p, sizeof(long))) {
+		if (fat_raw_ent_free(p, esize))
+			return p - start;
+		p += esize;
+	}
+	while (end - p >= sizeof(long)) {
+		lanes = fat_free_lanes(p, esize);
+		if (lanes)
+			return p - start + (__ffs(lanes) / (esize * 8)) * esize;
+		p += sizeof(long);
+	}
+	while (p < end) {
+		if (fat_raw_ent_free(p, esize))
+			break;
+		p += esize;
+	}
+	return p - start;
+}
+
+/* Optionally records each free entry in "map", indexed by entry */
+static __always_inline int fat_count_free_range(const u8 *p, const u8 *end,
+						int entry, unsigned long *map,
+						const int esize)
+{
+	const u8 *start = p;
+	unsigned long lanes;
+	int free = 0;
+
+	while (p < end && !IS_ALIGNED((unsigned long)p, sizeof(long))) {
+		if (fat_raw_ent_free(p, esize)) {
+			free++;
+			if (map)
+				__set_bit(entry + (p - start) / esize, map);
+		}
+		p += esize;
+	}
+	while (end - p >= sizeof(long)) {
+		lanes = fat_free_lanes(p, esize);
+		if (lanes) {
+			free += hweight_long(lanes);
+			while (map && lanes) {
+				__set_bit(entry + (p - start) / esize +
+					  __ffs(lanes) / (esize * 8), map);
+				lanes &= lanes - 1;
+			}
+		}
+		p += sizeof(long);
+	}
+	while (p < end) {
+		if (fat_raw_ent_free(p, esize)) {
+			free++;
+			if (map)
+				__set_bit(entry + (p - start) / esize, map);
+		}
+		p += esize;
+	}
+	return free;
+}
+
+/* End of the scan: the end of this block, or the entry "max" */
+static __always_inline u8 *fat_scan_end(struct fat_entry *fatent, u8 *p,
+					int max, const int esize)
+{
+	const struct buffer_head *bh = fatent->bhs[0];
+	u8 *end = (u8 *)bh->b_data + bh->b_size;
+
+	if ((end - p) / esize > max - fatent->entry)
+		end = p + (max - fatent->entry) * esize;
+	return end;
+}
+
+/*
+ * Moves fatent to the first free entry before "max" in its block and
+ * returns 1. Otherwise, fatent is moved past the scanned range with no
+ * pointer (like ->ent_next() at the end of block) and returns 0.
+ */
+static __always_inline int __fat_ent_find_free(struct fat_entry *fatent,
+					       u8 *p, int max, const int esize)
+{
+	u8 *end = fat_scan_end(fatent, p, max, esize);
+	int offset = fat_scan_free(p, end, esize);
+
+	fatent->entry += offset / esize;
+	if (p + offset == end) {
+		fatent->u.ent32_p = NULL;
+		return 0;
+	}
+	if (esize == 2)
+		fatent->u.ent16_p = (__le16 *)(p + offset);
+	else
+		fatent->u.ent32_p = (__le32 *)(p + offset);
+	return 1;
+}
+
+/*
+ * Counts the free entries from fatent to the end of its block (or
+ * "max"), and moves fatent past them with no pointer.
+ */
+static __always_inline int __fat_ent_count_free(struct fat_entry *fatent,
+						u8 *p, int max,
+						unsigned long *map,
+						const int esize)
+{
+	u8 *end = fat_scan_end(fatent, p, max, esize);
+	int entry = fatent->entry;
+
+	fatent->entry += (end - p) / esize;
+	fatent->u.ent32_p = NULL;
+	return fat_count_free_range(p, end, entry, map, esize);
+}
+
+static int fat16_ent_find_free(struct fat_entry *fatent, int max)
+{
+	return __fat_ent_find_free(fatent, (u8 *)fatent->u.ent16_p, max, 2);
+}
+
+static int fat32_ent_find_free(struct fat_entry *fatent, int max)
+{
+	return __fat_ent_find_free(fatent, (u8 *)fatent->u.ent32_p, max, 4);
+}
+
+static int fat16_ent_count_free(struct fat_entry *fatent, int max,
+				unsigned long *map)
+{
+	return __fat_ent_count_free(fatent, (u8 *)fatent->u.ent16_p, max,
+				    map, 2);
+}
+
+static int fat32_ent_count_free(struct fat_entry *fatent, int max,
+				unsigned long *map)
+{
+	return __fat_ent_count_free(fatent, (u8 *)fatent->u.ent32_p, max,
+				    map, 4);
+}
+
 static const struct fatent_operations fat12_ops = { // printk methods based on question 1
 	.ent_blocknr	= fat12_ent_blocknr,
 	.ent_set_ptr	= fat12_ent_set_ptr,
@@ -296,6 +489,8 @@ static const struct fatent_operations fat16_ops = {
 	.ent_get	= fat16_ent_get,
 	.ent_put	= fat16_ent_put,
 	.ent_next	= fat16_ent_next,
+	.ent_find_free	= fat16_ent_find_free,
+	.ent_count_free	= fat16_ent_count_free,
 };
 
 static const struct fatent_operations fat32_ops = {
@@ -305,23 +500,137 @@ static const struct fatent_operations fat32_ops = {
 	.ent_get	= fat32_ent_get,
 	.ent_put	= fat32_ent_put,
 	.ent_next	= fat32_ent_next,
+	.ent_find_free	= fat32_ent_find_free,
+	.ent_count_free	= fat32_ent_count_free,
 };
 
+/*
+ * The FAT is split into allocation groups of whole FAT blocks, each with
+ * its own mutex and free space summary. Allocating and freeing hold
+ * sbi->fat_lock for read and one group mutex at a time (a chain crossing
+ * groups is linked by its owner without the other group's mutex, since
+ * the entries in use are never touched by the other allocators), so they
+ * can't deadlock. The operations on the whole FAT (counting, mirroring,
+ * trimming) hold sbi->fat_lock for write instead.
+ *
+ * FAT12 entries straddle the blocks, so FAT12 has only one group.
+ */
+#define FAT_MAX_GROUPS		64
+#define FAT_GROUP_MIN_BLOCKS	16
+
 static inline void lock_fat(struct msdos_sb_info *sbi)
 {
-	mutex_lock(&sbi->fat_lock);
+	down_write(&sbi->fat_lock);
 }
 
 static inline void unlock_fat(struct msdos_sb_info *sbi)
 {
-	mutex_unlock(&sbi->fat_lock);
+	up_write(&sbi->fat_lock);
+}
+
+static inline struct fat_alloc_group *fat_entry_group(struct msdos_sb_info *sbi,
+						      int entry)
+{
+	/* the invalid entries are reported by fat_ent_read() */
+	if (entry < FAT_START_ENT || sbi->max_cluster <= entry)
+		entry = FAT_START_ENT;
+	return &sbi->alloc_groups[entry / sbi->group_entries];
+}
+
+static inline void lock_group(struct msdos_sb_info *sbi,
+			      struct fat_alloc_group *grp)
+{
+	down_read(&sbi->fat_lock);
+	mutex_lock(&grp->lock);
+}
+
+static inline void unlock_group(struct msdos_sb_info *sbi,
+				struct fat_alloc_group *grp)
+{
+	mutex_unlock(&grp->lock);
+	up_read(&sbi->fat_lock);
+}
+
+/* Switches the group lock to the one of "entry", with fat_lock held */
+static inline void fat_switch_group(struct msdos_sb_info *sbi,
+				    struct fat_alloc_group **grp, int entry)
+{
+	struct fat_alloc_group *new = fat_entry_group(sbi, entry);
+
+	if (new == *grp)
+		return;
+	if (*grp)
+		mutex_unlock(&(*grp)->lock);
+	mutex_lock(&new->lock);
+	*grp = new;
+}
+
+/* Accounts "delta" free clusters, with the group lock held */
+static void fat_update_free(struct msdos_sb_info *sbi,
+			    struct fat_alloc_group *grp, int delta)
+{
+	if (grp->free != -1)
+		grp->free += delta;
+
+	spin_lock(&sbi->free_lock);
+	if (sbi->free_clusters != -1)
+		sbi->free_clusters += delta;
+	spin_unlock(&sbi->free_lock);
+}
+
+static int fat_groups_init(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	unsigned long ent_per_block, nr_blocks, nr_groups;
+	int i;
+
+	if (sbi->fat_bits == 12) {
+		nr_groups = 1;
+		sbi->group_entries = sbi->max_cluster;
+	} else {
+		ent_per_block = (sb->s_blocksize * 8) / sbi->fat_bits;
+		nr_blocks = DIV_ROUND_UP(sbi->max_cluster, ent_per_block);
+		nr_groups = clamp_t(unsigned long,
+				    nr_blocks / FAT_GROUP_MIN_BLOCKS,
+				    1, FAT_MAX_GROUPS);
+		sbi->group_entries = DIV_ROUND_UP(nr_blocks, nr_groups)
+			* ent_per_block;
+		nr_groups = DIV_ROUND_UP(sbi->max_cluster, sbi->group_entries);
+	}
+
+	sbi->alloc_groups = kcalloc(nr_groups, sizeof(*sbi->alloc_groups),
+				    GFP_KERNEL);
+	if (!sbi->alloc_groups)
+		return -ENOMEM;
+	sbi->nr_groups = nr_groups;
+
+	for (i = 0; i < nr_groups; i++) {
+		struct fat_alloc_group *grp = &sbi->alloc_groups[i];
+
+		mutex_init(&grp->lock);
+		grp->start = max_t(int, i * sbi->group_entries, FAT_START_ENT);
+		grp->end = min_t(unsigned long, (i + 1) * sbi->group_entries,
+				 sbi->max_cluster);
+		grp->free = -1;
+		grp->prev_free = grp->start - 1;
+	}
+	/* start from the hint of FSINFO */
+	fat_entry_group(sbi, sbi->prev_free)->prev_free = sbi->prev_free;
+	return 0;
 }
 
-void fat_ent_access_init(struct super_block *sb)
+static void fat_orphan_workfn(struct work_struct *work);
+
+int fat_ent_access_init(struct super_block *sb)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 
-	mutex_init(&sbi->fat_lock);
+	init_rwsem(&sbi->fat_lock);
+	spin_lock_init(&sbi->free_lock);
+	spin_lock_init(&sbi->fat12_lock);
+	spin_lock_init(&sbi->orphan_lock);
+	INIT_LIST_HEAD(&sbi->orphans);
+	INIT_WORK(&sbi->orphan_work, fat_orphan_workfn);
 
 	switch (sbi->fat_bits) {
 	case 32:
@@ -337,6 +646,7 @@ void fat_ent_access_init(struct super_block *sb)
 		sbi->fatent_ops = &fat12_ops;
 		break;
 	}
+	return fat_groups_init(sb);
 }
 
 static void mark_fsinfo_dirty(struct super_block *sb)
@@ -405,9 +715,90 @@ int fat_ent_read(struct inode *inode, struct fat_entry *fatent, int entry)
 	return ops->ent_get(fatent);
 }
 
+/*
+ * Same as fat_ent_read(), but returns -EAGAIN instead of waiting for the
+ * FAT block to be read. For looking ahead along a chain, so it doesn't
+ * report the invalid entries either.
+ */
+int fat_ent_read_cached(struct inode *inode, struct fat_entry *fatent,
+			int entry)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	const struct fatent_operations *ops = sbi->fatent_ops;
+	struct buffer_head *bh;
+	int err, offset, uptodate;
+	sector_t blocknr;
+
+	if (entry < FAT_START_ENT || sbi->max_cluster <= entry)
+		return -EIO;
+
+	fatent_set_entry(fatent, entry);
+	ops->ent_blocknr(sb, entry, &offset, &blocknr);
+
+	if (!fat_ent_update_ptr(sb, fatent, offset, blocknr)) {
+		bh = sb_find_get_block(sb, blocknr);
+		if (!bh)
+			return -EAGAIN;
+		uptodate = buffer_uptodate(bh);
+		brelse(bh);
+		if (!uptodate)
+			return -EAGAIN;
+
+		fatent_brelse(fatent);
+		err = ops->ent_bread(sb, fatent, offset, blocknr);
+		if (err)
+			return err;
+	}
+	return ops->ent_get(fatent);
+}
+
+/* FAT read ahead of a chain walk */
+#define FAT_CHAIN_READA_SIZE	(32 * 1024)
+
+/*
+ * Chains mostly go forward through the FAT. When a walk gets to "entry"
+ * outside of the window it read ahead last, and that FAT block isn't in
+ * memory, this starts reading the next FAT_CHAIN_READA_SIZE of the FAT
+ * from there, so that the walk doesn't wait for each block in turn.
+ */
+void fat_ent_chain_reada(struct super_block *sb, int entry,
+			 struct fat_chain_ra *ra)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	const struct fatent_operations *ops = sbi->fatent_ops;
+	struct buffer_head *bh;
+	sector_t blocknr, fat_end, i;
+	int offset;
+
+	if (entry < FAT_START_ENT || sbi->max_cluster <= entry)
+		return;
+	ops->ent_blocknr(sb, entry, &offset, &blocknr);
+	if (ra->start <= blocknr && blocknr < ra->end)
+		return;
+
+	/* Nothing to wait for yet */
+	ra->start = blocknr;
+	ra->end = blocknr + 1;
+	bh = sb_find_get_block(sb, blocknr);
+	if (bh) {
+		int uptodate = buffer_uptodate(bh);
+
+		brelse(bh);
+		if (uptodate)
+			return;
+	}
+
+	fat_end = sbi->fat_start + sbi->fat_length;
+	ra->end = min_t(sector_t, fat_end,
+			blocknr + (FAT_CHAIN_READA_SIZE >> sb->s_blocksize_bits));
+	for (i = ra->start; i < ra->end; i++)
+		sb_breadahead(sb, i);
+}
+
 /* FIXME: We can write the blocks as more big chunk. */
-static int fat_mirror_bhs(struct super_block *sb, struct buffer_head **bhs,
-			  int nr_bhs)
+static int __fat_mirror_bhs(struct super_block *sb, struct buffer_head **bhs,
+			    int nr_bhs)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	struct buffer_head *c_bh;
@@ -437,6 +828,82 @@ error:
 	return err;
 }
 
+/*
+ * With "lazymirror", only remember which FAT blocks must be copied to
+ * the backup FATs, and let fat_mirror_flush() copy each of them once.
+ */
+static int fat_mirror_bhs(struct super_block *sb, struct buffer_head **bhs,
+			  int nr_bhs)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	int n;
+
+	if (sbi->mirror_dirty && !(sb->s_flags & MS_SYNCHRONOUS)) {
+		for (n = 0; n < nr_bhs; n++)
+			set_bit(bhs[n]->b_blocknr - sbi->fat_start,
+				sbi->mirror_dirty);
+		return 0;
+	}
+	return __fat_mirror_bhs(sb, bhs, nr_bhs);
+}
+
+static int fat_mirror_flush_bhs(struct super_block *sb,
+				struct buffer_head **bhs, int nr_bhs)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	int i, err;
+
+	err = __fat_mirror_bhs(sb, bhs, nr_bhs);
+	for (i = 0; i < nr_bhs; i++) {
+		/* try again at next flush */
+		if (err)
+			set_bit(bhs[i]->b_blocknr - sbi->fat_start,
+				sbi->mirror_dirty);
+		brelse(bhs[i]);
+	}
+	return err;
+}
+
+/* Copies the FAT blocks deferred by fat_mirror_bhs() to the backup FATs */
+int fat_mirror_flush(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct buffer_head *bhs[MAX_BUF_PER_PAGE];
+	unsigned long nr;
+	int nr_bhs = 0, err = 0;
+
+	if (!sbi->mirror_dirty)
+		return 0;
+
+	lock_fat(sbi);
+	for_each_set_bit(nr, sbi->mirror_dirty, sbi->fat_length) {
+		if (!test_and_clear_bit(nr, sbi->mirror_dirty))
+			continue;
+		bhs[nr_bhs] = sb_bread(sb, sbi->fat_start + nr);
+		if (!bhs[nr_bhs]) {
+			set_bit(nr, sbi->mirror_dirty);
+			fat_msg(sb, KERN_ERR, "FAT read failed (blocknr %llu)",
+				(llu)(sbi->fat_start + nr));
+			err = -EIO;
+			break;
+		}
+		if (++nr_bhs == MAX_BUF_PER_PAGE) {
+			err = fat_mirror_flush_bhs(sb, bhs, nr_bhs);
+			nr_bhs = 0;
+			if (err)
+				break;
+		}
+	}
+	if (nr_bhs) {
+		int err2 = fat_mirror_flush_bhs(sb, bhs, nr_bhs);
+		if (!err)
+			err = err2;
+	}
+	unlock_fat(sbi);
+
+	return err;
+}
+
 int fat_ent_write(struct inode *inode, struct fat_entry *fatent,
 		  int new, int wait)
 {
@@ -475,6 +942,80 @@ static inline int fat_ent_read_block(struct super_block *sb,
 	return ops->ent_bread(sb, fatent, offset, blocknr);
 }
 
+/*
+ * The scan loops below take the FAT width as a compile-time constant
+ * "bits" and are instantiated once per width by FAT_DISPATCH(), so the
+ * entry accessors are direct calls which can be inlined, instead of an
+ * indirect call through sbi->fatent_ops for each entry.
+ */
+#define FAT_DISPATCH(sbi, fn, ...)				\
+({								\
+	int __ret;						\
+	switch ((sbi)->fat_bits) {				\
+	case 12:						\
+		__ret = fn(__VA_ARGS__, 12);			\
+		break;						\
+	case 16:						\
+		__ret = fn(__VA_ARGS__, 16);			\
+		break;						\
+	default:						\
+		__ret = fn(__VA_ARGS__, 32);			\
+		break;						\
+	}							\
+	__ret;							\
+})
+
+static __always_inline int fat_get_w(struct fat_entry *fatent, const int bits)
+{
+	if (bits == 12)
+		return fat12_ent_get(fatent);
+	if (bits == 16)
+		return fat16_ent_get(fatent);
+	return fat32_ent_get(fatent);
+}
+
+static __always_inline void fat_put_w(struct fat_entry *fatent, int new,
+				      const int bits)
+{
+	if (bits == 12)
+		fat12_ent_put(fatent, new);
+	else if (bits == 16)
+		fat16_ent_put(fatent, new);
+	else
+		fat32_ent_put(fatent, new);
+}
+
+static __always_inline int fat_next_w(struct msdos_sb_info *sbi,
+				      struct fat_entry *fatent, const int bits)
+{
+	int ret;
+
+	if (bits == 12)
+		ret = fat12_ent_next(fatent);
+	else if (bits == 16)
+		ret = fat16_ent_next(fatent);
+	else
+		ret = fat32_ent_next(fatent);
+	return ret && fatent->entry < sbi->max_cluster;
+}
+
+/* FAT12 has no word-at-a-time helpers, the callers test "bits" first */
+static __always_inline int fat_find_free_w(struct fat_entry *fatent, int max,
+					   const int bits)
+{
+	if (bits == 16)
+		return fat16_ent_find_free(fatent, max);
+	return fat32_ent_find_free(fatent, max);
+}
+
+static __always_inline int fat_count_free_w(struct fat_entry *fatent, int max,
+					    unsigned long *map, const int bits)
+{
+	if (bits == 16)
+		return fat16_ent_count_free(fatent, max, map);
+	return fat32_ent_count_free(fatent, max, map);
+}
+
 static void fat_collect_bhs(struct buffer_head **bhs, int *nr_bhs,
 			    struct fat_entry *fatent)
 {
@@ -493,108 +1034,439 @@ static void fat_collect_bhs(struct buffer_head **bhs, int *nr_bhs,
 	}
 }
 
-int fat_alloc_clusters(struct inode *inode, int *cluster, int nr_cluster)
+/*
+ * Writes the FAT blocks collected by fat_collect_bhs() to the disk (if
+ * "sync") and to the backup FATs, then drops them from bhs[].
+ */
+static int fat_flush_bhs(struct super_block *sb, struct buffer_head **bhs,
+			 int *nr_bhs, int sync)
 {
-	struct super_block *sb = inode->i_sb;
-	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	const struct fatent_operations *ops = sbi->fatent_ops;
+	int i, err = 0;
+
+	if (sync)
+		err = fat_sync_bhs(bhs, *nr_bhs);
+	if (!err)
+		err = fat_mirror_bhs(sb, bhs, *nr_bhs);
+	for (i = 0; i < *nr_bhs; i++)
+		brelse(bhs[i]);
+	*nr_bhs = 0;
+	return err;
+}
+
+struct fat_alloc_context {
+	struct inode *inode;
 	struct fat_entry fatent, prev_ent;
 	struct buffer_head *bhs[MAX_BUF_PER_PAGE];
-	int i, count, err, nr_bhs, idx_clus;
-
-	BUG_ON(nr_cluster > (MAX_BUF_PER_PAGE / 2));	/* fixed limit */
+	int nr_bhs;
+	int *cluster;
+	int nr_cluster, idx_clus;
+	bool record;
+	int sync;
+	int goal;		/* entry to start from, or 0 */
+	int last;		/* last allocated entry */
+};
 
-	lock_fat(sbi);
-	if (sbi->free_clusters != -1 && sbi->free_clus_valid &&
-	    sbi->free_clusters < nr_cluster) {
-		unlock_fat(sbi);
-		return -ENOSPC;
-	}
+/*
+ * Allocates the free entries in "grp" (with its lock held) until the
+ * request is satisfied or the group has no free entry anymore.
+ */
+static __always_inline int __fat_alloc_in_group(struct fat_alloc_context *ac,
+						struct fat_alloc_group *grp,
+						const int bits)
+{
+	struct super_block *sb = ac->inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_entry *fatent = &ac->fatent;
+	int count, err, nr_entries = grp->end - grp->start;
 
-	err = nr_bhs = idx_clus = 0;
-	count = FAT_START_ENT;
-	fatent_init(&prev_ent);
-	fatent_init(&fatent);
-	fatent_set_entry(&fatent, sbi->prev_free + 1);
-	while (count < sbi->max_cluster) {
-		if (fatent.entry >= sbi->max_cluster)
-			fatent.entry = FAT_START_ENT;
-		fatent_set_entry(&fatent, fatent.entry);
-		err = fat_ent_read_block(sb, &fatent);
+	count = 0;
+	/* Start from the goal in its group, else after the last allocation */
+	if (ac->goal >= grp->start && ac->goal < grp->end)
+		fatent_set_entry(fatent, ac->goal);
+	else
+		fatent_set_entry(fatent, grp->prev_free + 1);
+	while (count < nr_entries) {
+		if (fatent->entry >= grp->end)
+			fatent->entry = grp->start;
+		if (sbi->free_map_valid) {
+			/* Skip the blocks which have no free entry */
+			int next = find_next_bit(sbi->free_map, grp->end,
+						 fatent->entry);
+			count += next - fatent->entry;
+			fatent->entry = next;
+			if (next >= grp->end)
+				continue;
+		}
+		fatent_set_entry(fatent, fatent->entry);
+		err = fat_ent_read_block(sb, fatent);
 		if (err)
-			goto out;
+			return err;
 
 		/* Find the free entries in a block */
 		do {
-			if (ops->ent_get(&fatent) == FAT_ENT_FREE) {
-				int entry = fatent.entry;
+			if (bits != 12) {
+				int start = fatent->entry;
+				int found;
+
+				found = fat_find_free_w(fatent,
+					min(grp->end,
+					    start + nr_entries - count), bits);
+				count += fatent->entry - start;
+				if (!found)
+					break;
+			}
+			if (fat_get_w(fatent, bits) == FAT_ENT_FREE) {
+				int entry = fatent->entry;
 
 				/* make the cluster chain */
-				ops->ent_put(&fatent, FAT_ENT_EOF);
-				if (prev_ent.nr_bhs)
-					ops->ent_put(&prev_ent, entry);
-
-				fat_collect_bhs(bhs, &nr_bhs, &fatent);
+				fat_put_w(fatent, FAT_ENT_EOF, bits);
+				if (ac->prev_ent.nr_bhs)
+					fat_put_w(&ac->prev_ent, entry, bits);
 
+				/*
+				 * prev_ent was linked for the last time, so
+				 * all collected blocks can be written out.
+				 */
+				if (ac->nr_bhs + fatent->nr_bhs >
+				    MAX_BUF_PER_PAGE) {
+					err = fat_flush_bhs(sb, ac->bhs,
+							    &ac->nr_bhs,
+							    ac->sync);
+					if (err)
+						return err;
+				}
+				fat_collect_bhs(ac->bhs, &ac->nr_bhs, fatent);
+
+				grp->prev_free = entry;
 				sbi->prev_free = entry;
-				if (sbi->free_clusters != -1)
-					sbi->free_clusters--;
+				fat_update_free(sbi, grp, -1);
+				if (sbi->free_map_valid)
+					__clear_bit(entry, sbi->free_map);
 
-				cluster[idx_clus] = entry;
-				idx_clus++;
-				if (idx_clus == nr_cluster)
-					goto out;
+				if (ac->record || !ac->idx_clus)
+					ac->cluster[ac->idx_clus] = entry;
+				ac->idx_clus++;
+				ac->last = entry;
+				if (ac->idx_clus == ac->nr_cluster)
+					return 0;
 
 				/*
 				 * fat_collect_bhs() gets ref-count of bhs,
 				 * so we can still use the prev_ent.
 				 */
-				prev_ent = fatent;
+				ac->prev_ent = *fatent;
 			}
 			count++;
-			if (count == sbi->max_cluster)
+			if (count == nr_entries)
 				break;
-		} while (fat_ent_next(sbi, &fatent));
-	}
-
-	/* Couldn't allocate the free entries */
-	sbi->free_clusters = 0;
-	sbi->free_clus_valid = 1;
-	err = -ENOSPC;
-
-out:
-	unlock_fat(sbi);
-	mark_fsinfo_dirty(sb);
-	fatent_brelse(&fatent);
-	if (!err) {
-		if (inode_needs_sync(inode))
-			err = fat_sync_bhs(bhs, nr_bhs);
-		if (!err)
-			err = fat_mirror_bhs(sb, bhs, nr_bhs);
+		} while (fat_next_w(sbi, fatent, bits) &&
+			 fatent->entry < grp->end);
 	}
-	for (i = 0; i < nr_bhs; i++)
-		brelse(bhs[i]);
 
-	if (err && idx_clus)
-		fat_free_clusters(inode, cluster[0]);
+	/* This group has no free entries anymore */
+	grp->free = 0;
+	return 0;
+}
 
-	return err;
+static int fat_alloc_in_group(struct fat_alloc_context *ac,
+			      struct fat_alloc_group *grp)
+{
+	return FAT_DISPATCH(MSDOS_SB(ac->inode->i_sb), __fat_alloc_in_group,
+			    ac, grp);
 }
 
-int fat_free_clusters(struct inode *inode, int cluster)
+static void fat_alloc_init(struct fat_alloc_context *ac, struct inode *inode,
+			   int *cluster, int nr_cluster, bool record)
 {
-	struct super_block *sb = inode->i_sb;
+	ac->inode = inode;
+	fatent_init(&ac->prev_ent);
+	fatent_init(&ac->fatent);
+	ac->nr_bhs = 0;
+	ac->cluster = cluster;
+	ac->nr_cluster = nr_cluster;
+	ac->idx_clus = 0;
+	ac->record = record;
+	ac->sync = inode_needs_sync(inode);
+	ac->goal = 0;
+	ac->last = 0;
+}
+
+/*
+ * Writes out the rest of the FAT blocks, or frees the partial chain if
+ * the allocation failed. Called without fat_lock.
+ */
+static int fat_alloc_done(struct fat_alloc_context *ac, int err)
+{
+	struct super_block *sb = ac->inode->i_sb;
+	int i;
+
+	mark_fsinfo_dirty(sb);
+	fatent_brelse(&ac->fatent);
+	if (!err)
+		err = fat_flush_bhs(sb, ac->bhs, &ac->nr_bhs, ac->sync);
+	for (i = 0; i < ac->nr_bhs; i++)
+		brelse(ac->bhs[i]);
+
+	if (err && ac->idx_clus)
+		fat_free_clusters(ac->inode, ac->cluster[0]);
+	else if (!err)
+		MSDOS_I(ac->inode)->i_alloc_goal = ac->last + 1;
+
+	return err;
+}
+
+/*
+ * Picks the entry to start the allocation from: the one after the last
+ * cluster allocated to the file, or the cluster holding the directory
+ * entry of a new file, so that a file stays contiguous and close to its
+ * directory. Returns 0 if there is no goal.
+ */
+static int fat_alloc_goal(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+	sector_t blknr;
+	loff_t i_pos;
+	int goal = 0, offset;
+
+	if (ei->i_alloc_goal)
+		goal = ei->i_alloc_goal;
+	else if (ei->i_start)
+		goal = ei->i_start;
+	else {
+		i_pos = fat_i_pos_read(sbi, inode);
+		fat_get_blknr_offset(sbi, i_pos, &blknr, &offset);
+		/* The FAT12/16 root directory isn't in the data area */
+		if (i_pos && blknr >= sbi->data_start)
+			goal = ((blknr - sbi->data_start) >>
+				(sbi->cluster_bits - sb->s_blocksize_bits))
+				+ FAT_START_ENT;
+	}
+
+	if (goal < FAT_START_ENT || goal >= sbi->max_cluster)
+		return 0;
+	return goal;
+}
+
+/*
+ * Allocates nr_cluster free clusters as one chain. If "record", all the
+ * cluster numbers are stored to cluster[], otherwise only the first one
+ * to cluster[0]. The dirty FAT blocks are flushed whenever bhs[] fills
+ * up, so the number of clusters isn't limited.
+ */
+static int __fat_alloc_clusters(struct inode *inode, int *cluster,
+				int nr_cluster, bool record)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_alloc_context ac;
+	int g, tried, err = 0;
+
+	if (sbi->free_clusters != -1 && sbi->free_clus_valid &&
+	    sbi->free_clusters < nr_cluster)
+		return -ENOSPC;
+
+	fat_alloc_init(&ac, inode, cluster, nr_cluster, record);
+	/* Start from the group of the goal, or of this CPU */
+	ac.goal = fat_alloc_goal(inode);
+	if (ac.goal)
+		g = ac.goal / sbi->group_entries;
+	else
+		g = raw_smp_processor_id() % sbi->nr_groups;
+	for (tried = 0; tried < sbi->nr_groups; tried++) {
+		struct fat_alloc_group *grp = &sbi->alloc_groups[g];
+
+		lock_group(sbi, grp);
+		if (grp->free)
+			err = fat_alloc_in_group(&ac, grp);
+		unlock_group(sbi, grp);
+		if (err || ac.idx_clus == nr_cluster)
+			break;
+		if (++g == sbi->nr_groups)
+			g = 0;
+	}
+
+	if (!err && ac.idx_clus < nr_cluster) {
+		/* Couldn't allocate the free entries */
+		if (sbi->nr_groups == 1) {
+			spin_lock(&sbi->free_lock);
+			sbi->free_clusters = 0;
+			sbi->free_clus_valid = 1;
+			spin_unlock(&sbi->free_lock);
+		}
+		err = -ENOSPC;
+	}
+
+	return fat_alloc_done(&ac, err);
+}
+
+/* The orphans being freed in background may give the space we need */
+static int fat_alloc_retry(struct inode *inode, int *cluster, int nr_cluster,
+			   bool record)
+{
+	int err;
+
+	err = __fat_alloc_clusters(inode, cluster, nr_cluster, record);
+	if (err == -ENOSPC && fat_orphan_drain(inode->i_sb))
+		err = __fat_alloc_clusters(inode, cluster, nr_cluster, record);
+	return err;
+}
+
+int fat_alloc_clusters(struct inode *inode, int *cluster, int nr_cluster)
+{
+	return fat_alloc_retry(inode, cluster, nr_cluster, true);
+}
+
+/*
+ * Allocates a chain of nr_cluster clusters in one go, and returns the
+ * first cluster of it to *first.
+ */
+int fat_alloc_chain(struct inode *inode, int *first, int nr_cluster)
+{
+	return fat_alloc_retry(inode, first, nr_cluster, false);
+}
+
+static __always_inline int __fat_scan_free_run(struct super_block *sb,
+						int nr_cluster, const int bits)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_entry fatent;
+	int run_start = 0, run_len = 0, err;
+
+	fatent_init(&fatent);
+	fatent_set_entry(&fatent, FAT_START_ENT);
+	while (fatent.entry < sbi->max_cluster) {
+		err = fat_ent_read_block(sb, &fatent);
+		if (err)
+			goto out;
+
+		do {
+			/* Skip the entries in use until a run starts */
+			if (!run_len && bits != 12 &&
+			    !fat_find_free_w(&fatent, sbi->max_cluster, bits))
+				break;
+			if (fat_get_w(&fatent, bits) != FAT_ENT_FREE) {
+				run_len = 0;
+				continue;
+			}
+			if (!run_len++)
+				run_start = fatent.entry;
+			if (run_len == nr_cluster) {
+				err = run_start;
+				goto out;
+			}
+		} while (fat_next_w(sbi, &fatent, bits));
+	}
+	err = -ENOSPC;
+out:
+	fatent_brelse(&fatent);
+	return err;
+}
+
+/*
+ * Finds the first run of nr_cluster free entries, with fat_lock held for
+ * write. Returns the first entry of the run, or -ENOSPC.
+ */
+static int fat_find_free_run(struct super_block *sb, int nr_cluster)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+
+	if (sbi->free_map_valid) {
+		unsigned long start = FAT_START_ENT, end;
+
+		for (;;) {
+			start = find_next_bit(sbi->free_map, sbi->max_cluster,
+					      start);
+			if (start >= sbi->max_cluster)
+				return -ENOSPC;
+			end = find_next_zero_bit(sbi->free_map,
+						 sbi->max_cluster, start);
+			if (end - start >= nr_cluster)
+				return start;
+			start = end;
+		}
+	}
+
+	return FAT_DISPATCH(sbi, __fat_scan_free_run, sb, nr_cluster);
+}
+
+/*
+ * Allocates nr_cluster contiguous clusters as one chain, and returns the
+ * first cluster of it to *first. The whole FAT is locked while the run is
+ * searched, so this is meant for the rare users like defragmentation.
+ */
+int fat_alloc_contig(struct inode *inode, int *first, int nr_cluster)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_alloc_context ac;
+	struct fat_alloc_group run;
+	int i, start, err = 0;
+
+	fat_alloc_init(&ac, inode, first, nr_cluster, false);
+
+	/* The orphans may hold the run we are looking for */
+	fat_orphan_drain(sb);
+
+	lock_fat(sbi);
+	if (sbi->free_clusters != -1 && sbi->free_clus_valid &&
+	    sbi->free_clusters < nr_cluster) {
+		err = -ENOSPC;
+		goto out;
+	}
+	start = fat_find_free_run(sb, nr_cluster);
+	if (start < 0) {
+		err = start;
+		goto out;
+	}
+
+	/* The run is allocated as a group of its own */
+	run.start = start;
+	run.end = start + nr_cluster;
+	run.free = -1;
+	run.prev_free = start - 1;
+	err = fat_alloc_in_group(&ac, &run);
+	if (!err && ac.idx_clus < nr_cluster) {
+		fat_fs_error(sb, "%s: free run at %d was modified",
+			     __func__, start);
+		err = -EIO;
+	}
+
+	/* Account the allocated entries to the real groups */
+	for (i = 0; i < ac.idx_clus; i++) {
+		struct fat_alloc_group *grp = fat_entry_group(sbi, start + i);
+
+		if (grp->free != -1)
+			grp->free--;
+	}
+out:
+	unlock_fat(sbi);
+	return fat_alloc_done(&ac, err);
+}
+
+/*
+ * Frees up to "max" clusters (or the whole chain if "max" is 0) of the
+ * chain starting at "cluster", and returns the rest of the chain to
+ * *next, or FAT_ENT_EOF if the whole chain was freed.
+ */
+static int __fat_free_clusters(struct inode *inode, int cluster, int max,
+			       int *next)
+{
+	struct super_block *sb = inode->i_sb;
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	const struct fatent_operations *ops = sbi->fatent_ops;
 	struct fat_entry fatent;
 	struct buffer_head *bhs[MAX_BUF_PER_PAGE];
-	int i, err, nr_bhs;
+	struct fat_alloc_group *grp = NULL;
+	int i, err, nr_bhs, nr_freed = 0;
 	int first_cl = cluster, dirty_fsinfo = 0;
 
 	nr_bhs = 0;
 	fatent_init(&fatent);
-	lock_fat(sbi);
+	down_read(&sbi->fat_lock);
 	do {
+		fat_switch_group(sbi, &grp, cluster);
 		cluster = fat_ent_read(inode, &fatent, cluster);
 		if (cluster < 0) {
 			err = cluster;
@@ -605,6 +1477,7 @@ int fat_free_clusters(struct inode *inode, int cluster)
 			err = -EIO;
 			goto error;
 		}
+		nr_freed++;
 
 		if (sbi->options.discard) {
 			/*
@@ -612,7 +1485,7 @@ int fat_free_clusters(struct inode *inode, int cluster)
 			 * care about, batching contiguous clusters
 			 * into one request
 			 */
-			if (cluster != fatent.entry + 1) {
+			if (cluster != fatent.entry + 1 || nr_freed == max) {
 				int nr_clus = fatent.entry - first_cl + 1;
 
 				sb_issue_discard(sb,
@@ -625,45 +1498,136 @@ int fat_free_clusters(struct inode *inode, int cluster)
 		}
 
 		ops->ent_put(&fatent, FAT_ENT_FREE);
-		if (sbi->free_clusters != -1) {
-			sbi->free_clusters++;
+		if (sbi->free_map_valid)
+			__set_bit(fatent.entry, sbi->free_map);
+		if (sbi->trim_clean)
+			clear_bit(fatent.entry / FAT_TRIM_GROUP,
+				  sbi->trim_clean);
+		if (sbi->free_clusters != -1)
 			dirty_fsinfo = 1;
-		}
+		fat_update_free(sbi, grp, 1);
 
 		if (nr_bhs + fatent.nr_bhs > MAX_BUF_PER_PAGE) {
-			if (sb->s_flags & MS_SYNCHRONOUS) {
-				err = fat_sync_bhs(bhs, nr_bhs);
-				if (err)
-					goto error;
-			}
-			err = fat_mirror_bhs(sb, bhs, nr_bhs);
+			err = fat_flush_bhs(sb, bhs, &nr_bhs,
+					    sb->s_flags & MS_SYNCHRONOUS);
 			if (err)
 				goto error;
-			for (i = 0; i < nr_bhs; i++)
-				brelse(bhs[i]);
-			nr_bhs = 0;
 		}
 		fat_collect_bhs(bhs, &nr_bhs, &fatent);
-	} while (cluster != FAT_ENT_EOF);
+	} while (cluster != FAT_ENT_EOF && nr_freed != max);
 
-	if (sb->s_flags & MS_SYNCHRONOUS) {
-		err = fat_sync_bhs(bhs, nr_bhs);
-		if (err)
-			goto error;
-	}
-	err = fat_mirror_bhs(sb, bhs, nr_bhs);
+	*next = cluster;
+	err = fat_flush_bhs(sb, bhs, &nr_bhs, sb->s_flags & MS_SYNCHRONOUS);
 error:
 	fatent_brelse(&fatent);
 	for (i = 0; i < nr_bhs; i++)
 		brelse(bhs[i]);
-	unlock_fat(sbi);
+	if (grp)
+		mutex_unlock(&grp->lock);
+	up_read(&sbi->fat_lock);
 	if (dirty_fsinfo)
 		mark_fsinfo_dirty(sb);
 
 	return err;
 }
+
+int fat_free_clusters(struct inode *inode, int cluster)
+{
+	int next;
+
+	return __fat_free_clusters(inode, cluster, 0, &next);
+}
 EXPORT_SYMBOL_GPL(fat_free_clusters);
 
+/*
+ * The big chains cut off by truncate and unlink are recorded as orphans
+ * and freed by a background worker, FAT_ORPHAN_BATCH clusters at a time,
+ * so that the free space comes back gradually while the caller returns
+ * at once. The directory entry doesn't point to an orphan anymore, so a
+ * crash only leaves lost clusters behind. The journal records the head
+ * of each orphan, its new head after each batch, and its end, so the
+ * last record of a chain which isn't freed tells where the lost ones
+ * start.
+ */
+#define FAT_ORPHAN_BATCH	1024
+
+struct fat_orphan {
+	struct list_head list;
+	int cluster;		/* head of the rest of the chain */
+};
+
+static void fat_orphan_workfn(struct work_struct *work)
+{
+	struct msdos_sb_info *sbi =
+		container_of(work, struct msdos_sb_info, orphan_work);
+	struct fat_orphan *orphan;
+	int err, next;
+
+	spin_lock(&sbi->orphan_lock);
+	while (!list_empty(&sbi->orphans)) {
+		/* Only this worker removes or updates the orphans */
+		orphan = list_first_entry(&sbi->orphans, struct fat_orphan,
+					  list);
+		spin_unlock(&sbi->orphan_lock);
+
+		err = __fat_free_clusters(sbi->fat_inode, orphan->cluster,
+					  FAT_ORPHAN_BATCH, &next);
+		cond_resched();
+
+		/* on error, the last record still tells what is lost */
+		if (!err)
+			method_orphan(sbi, orphan->cluster, next);
+
+		spin_lock(&sbi->orphan_lock);
+		if (err || next == FAT_ENT_EOF) {
+			list_del(&orphan->list);
+			kfree(orphan);
+		} else
+			orphan->cluster = next;
+	}
+	spin_unlock(&sbi->orphan_lock);
+}
+
+/*
+ * Hands the chain starting at "cluster" to the background worker. The
+ * chain must not be reachable from the inode anymore.
+ */
+int fat_free_clusters_async(struct inode *inode, int cluster)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	struct fat_orphan *orphan;
+
+	orphan = kmalloc(sizeof(*orphan), GFP_NOFS);
+	if (!orphan)
+		return fat_free_clusters(inode, cluster);
+	orphan->cluster = cluster;
+	method_orphan(sbi, cluster, cluster);
+
+	spin_lock(&sbi->orphan_lock);
+	list_add_tail(&orphan->list, &sbi->orphans);
+	spin_unlock(&sbi->orphan_lock);
+	queue_work(system_long_wq, &sbi->orphan_work);
+	return 0;
+}
+
+/*
+ * Waits until all the orphans are freed. Returns false if there was none,
+ * in which case a queued worker may still run: fat_put_super() flushes it.
+ */
+bool fat_orphan_drain(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	bool pending;
+
+	spin_lock(&sbi->orphan_lock);
+	pending = !list_empty(&sbi->orphans);
+	spin_unlock(&sbi->orphan_lock);
+
+	if (pending)
+		flush_work(&sbi->orphan_work);
+	return pending;
+}
+
 /* 128kb is the whole sectors for FAT12 and FAT16 */
 #define FAT_READA_SIZE		(128 * 1024)
 
@@ -680,29 +1644,37 @@ static void fat_ent_reada(struct super_block *sb, struct fat_entry *fatent,
 		sb_breadahead(sb, blocknr + i);
 }
 
-int fat_count_free_clusters(struct super_block *sb)
+/*
+ * Counts the free entries in [start, end), recording them in "map" if
+ * it's not NULL. FAT12 can only be counted as one range, because its
+ * entries straddle the blocks.
+ */
+static __always_inline int __fat_count_range(struct super_block *sb,
+					     int start, int end,
+					     unsigned long *map, int *nr_free,
+					     const int bits)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	const struct fatent_operations *ops = sbi->fatent_ops;
 	struct fat_entry fatent;
-	unsigned long reada_blocks, reada_mask, cur_block;
-	int err = 0, free;
+	unsigned long reada_blocks, reada_mask, cur_block, nr_blocks;
+	sector_t first, last;
+	int err = 0, free = 0, offset;
 
-	lock_fat(sbi);
-	if (sbi->free_clusters != -1 && sbi->free_clus_valid)
-		goto out;
+	ops->ent_blocknr(sb, start, &offset, &first);
+	ops->ent_blocknr(sb, end - 1, &offset, &last);
+	nr_blocks = last - first + 1;
 
 	reada_blocks = FAT_READA_SIZE >> sb->s_blocksize_bits;
 	reada_mask = reada_blocks - 1;
 	cur_block = 0;
 
-	free = 0;
 	fatent_init(&fatent);
-	fatent_set_entry(&fatent, FAT_START_ENT);
-	while (fatent.entry < sbi->max_cluster) {
+	fatent_set_entry(&fatent, start);
+	while (fatent.entry < end) {
 		/* readahead of fat blocks */
 		if ((cur_block & reada_mask) == 0) {
-			unsigned long rest = sbi->fat_length - cur_block;
+			unsigned long rest = nr_blocks - cur_block;
 			fat_ent_reada(sb, &fatent, min(reada_blocks, rest));
 		}
 		cur_block++;
@@ -711,16 +1683,419 @@ int fat_count_free_clusters(struct super_block *sb)
 		if (err)
 			goto out;
 
+		if (bits != 12) {
+			free += fat_count_free_w(&fatent, end, map, bits);
+			continue;
+		}
 		do {
-			if (ops->ent_get(&fatent) == FAT_ENT_FREE)
+			if (fat_get_w(&fatent, bits) == FAT_ENT_FREE) {
 				free++;
-		} while (fat_ent_next(sbi, &fatent));
+				if (map)
+					__set_bit(fatent.entry, map);
+			}
+		} while (fat_next_w(sbi, &fatent, bits) &&
+			 fatent.entry < end);
+	}
+	*nr_free = free;
+out:
+	fatent_brelse(&fatent);
+	return err;
+}
+
+static int fat_count_range(struct super_block *sb, int start, int end,
+			   unsigned long *map, int *nr_free)
+{
+	return FAT_DISPATCH(MSDOS_SB(sb), __fat_count_range, sb, start, end,
+			    map, nr_free);
+}
+
+/* Upper limit of the concurrent FAT scanners */
+#define FAT_COUNT_WORKERS	8
+
+struct fat_count_work {
+	struct work_struct work;
+	struct super_block *sb;
+	int first, last;		/* range of allocation groups */
+	unsigned long *map;
+	int err;
+	atomic_t *pending;
+	struct completion *done;
+};
+
+/* Counts the free entries of each group in [first, last) */
+static int fat_count_groups(struct super_block *sb, int first, int last,
+			    unsigned long *map)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	int i, err;
+
+	for (i = first; i < last; i++) {
+		struct fat_alloc_group *grp = &sbi->alloc_groups[i];
+
+		err = fat_count_range(sb, grp->start, grp->end, map,
+				      &grp->free);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static void fat_count_workfn(struct work_struct *work)
+{
+	struct fat_count_work *cw =
+		container_of(work, struct fat_count_work, work);
+
+	cw->err = fat_count_groups(cw->sb, cw->first, cw->last, cw->map);
+	if (atomic_dec_and_test(cw->pending))
+		complete(cw->done);
+}
+
+/*
+ * Scans the allocation groups concurrently, each worker with its own
+ * readahead stream, so that a big FAT is read at the device bandwidth.
+ * The groups start at multiple of the entries per block, so the workers
+ * never share a word of "map".
+ *
+ * Returns -EAGAIN if the FAT should be scanned serially instead.
+ */
+static int fat_count_parallel(struct super_block *sb, unsigned long *map)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct fat_count_work *works;
+	unsigned long reada_blocks;
+	atomic_t pending;
+	int i, nr_works, groups_per_work, err = 0;
+
+	reada_blocks = FAT_READA_SIZE >> sb->s_blocksize_bits;
+	if (sbi->nr_groups < 2 || sbi->fat_length < reada_blocks * 2)
+		return -EAGAIN;
+
+	nr_works = min(FAT_COUNT_WORKERS, sbi->nr_groups);
+	groups_per_work = DIV_ROUND_UP(sbi->nr_groups, nr_works);
+	nr_works = DIV_ROUND_UP(sbi->nr_groups, groups_per_work);
+	works = kcalloc(nr_works, sizeof(*works), GFP_NOFS);
+	if (!works)
+		return -EAGAIN;
+
+	atomic_set(&pending, nr_works);
+	for (i = 0; i < nr_works; i++) {
+		struct fat_count_work *cw = &works[i];
+
+		cw->sb = sb;
+		cw->first = i * groups_per_work;
+		cw->last = min(cw->first + groups_per_work, sbi->nr_groups);
+		cw->map = map;
+		cw->pending = &pending;
+		cw->done = &done;
+		INIT_WORK(&cw->work, fat_count_workfn);
+		queue_work(system_unbound_wq, &cw->work);
 	}
+	wait_for_completion(&done);
+
+	for (i = 0; i < nr_works; i++) {
+		if (works[i].err && !err)
+			err = works[i].err;
+	}
+	kfree(works);
+	return err;
+}
+
+int fat_count_free_clusters(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	unsigned long *map = NULL;
+	int i, err = 0, free;
+
+	lock_fat(sbi);
+	if (sbi->free_clusters != -1 && sbi->free_clus_valid &&
+	    (!sbi->free_map || sbi->free_map_valid))
+		goto out;
+
+	/* Build the free cluster map as side effect of the scan */
+	if (sbi->free_map) {
+		map = sbi->free_map;
+		sbi->free_map_valid = 0;
+		bitmap_zero(map, sbi->max_cluster);
+	}
+
+	err = fat_count_parallel(sb, map);
+	if (err == -EAGAIN)
+		err = fat_count_groups(sb, 0, sbi->nr_groups, map);
+	if (err) {
+		for (i = 0; i < sbi->nr_groups; i++)
+			sbi->alloc_groups[i].free = -1;
+		goto out;
+	}
+
+	free = 0;
+	for (i = 0; i < sbi->nr_groups; i++)
+		free += sbi->alloc_groups[i].free;
 	sbi->free_clusters = free;
 	sbi->free_clus_valid = 1;
+	if (map)
+		sbi->free_map_valid = 1;
 	mark_fsinfo_dirty(sb);
-	fatent_brelse(&fatent);
 out:
 	unlock_fat(sbi);
 	return err;
 }
+
+/*
+ * FITRIM support. A bit of sbi->trim_clean is set when all the free
+ * clusters of the FAT_TRIM_GROUP clusters it covers were discarded, and
+ * cleared when fat_free_clusters() frees a cluster in the group again,
+ * so the next FITRIM can skip the groups with nothing new to discard.
+ */
+
+struct fat_trim_state {
+	struct super_block *sb;
+	u64 minlen;			/* in clusters */
+	u64 trimmed;			/* in clusters */
+	int run_start, run_len;		/* free run to be discarded */
+	/* groups which become clean when the current run is discarded */
+	unsigned long pend_start, pend_end;
+	bool skipped;			/* dropped a short run in this group */
+};
+
+static int fat_trim_clusters(struct super_block *sb, u32 clus, u32 nr_clus)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	return sb_issue_discard(sb, fat_clus_to_blknr(sbi, clus),
+				nr_clus * sbi->sec_per_clus, GFP_NOFS, 0);
+}
+
+static void fat_trim_pend_commit(struct fat_trim_state *st)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(st->sb);
+
+	if (st->pend_end > st->pend_start)
+		bitmap_set(sbi->trim_clean, st->pend_start,
+			   st->pend_end - st->pend_start);
+	st->pend_start = st->pend_end = 0;
+}
+
+/* Discards the current free run if it is long enough */
+static int fat_trim_flush(struct fat_trim_state *st)
+{
+	int err = 0;
+
+	if (!st->run_len)
+		return 0;
+	if (st->run_len >= st->minlen) {
+		err = fat_trim_clusters(st->sb, st->run_start, st->run_len);
+		if (!err) {
+			st->trimmed += st->run_len;
+			fat_trim_pend_commit(st);
+		}
+	} else
+		st->skipped = true;
+	/* the pending groups still have untrimmed free clusters */
+	st->pend_start = st->pend_end = 0;
+	st->run_len = 0;
+	return err;
+}
+
+/* Adds free clusters, merging with the current run if contiguous */
+static int fat_trim_add(struct fat_trim_state *st, int clus, int nr_clus)
+{
+	int err = 0;
+
+	if (st->run_len && st->run_start + st->run_len == clus) {
+		st->run_len += nr_clus;
+		return 0;
+	}
+	err = fat_trim_flush(st);
+	st->run_start = clus;
+	st->run_len = nr_clus;
+	return err;
+}
+
+/* The whole "group" was scanned */
+static void fat_trim_group_done(struct fat_trim_state *st,
+				unsigned long group)
+{
+	/* the group still has free clusters which were not discarded */
+	if (st->skipped)
+		return;
+	if (!st->run_len) {
+		set_bit(group, MSDOS_SB(st->sb)->trim_clean);
+		return;
+	}
+	/* wait for the current run which may extend into this group */
+	if (st->pend_end != group)
+		st->pend_start = group;
+	st->pend_end = group + 1;
+}
+
+/* Feeds the free clusters in [start, end) from the free cluster map */
+static int fat_trim_scan_map(struct fat_trim_state *st, int start, int end)
+{
+	unsigned long *map = MSDOS_SB(st->sb)->free_map;
+	unsigned long clus = start, run_end;
+	int err;
+
+	while (1) {
+		clus = find_next_bit(map, end, clus);
+		if (clus >= end)
+			break;
+		run_end = find_next_zero_bit(map, end, clus);
+		err = fat_trim_add(st, clus, run_end - clus);
+		if (err)
+			return err;
+		clus = run_end;
+	}
+	return 0;
+}
+
+/* Feeds the free clusters in [start, end) from the FAT */
+static __always_inline int __fat_trim_scan_fat(struct fat_trim_state *st,
+					       struct fat_entry *fatent,
+					       int start, int end,
+					       const int bits)
+{
+	struct super_block *sb = st->sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	int err;
+
+	fatent_set_entry(fatent, start);
+	while (fatent->entry < end) {
+		err = fat_ent_read_block(sb, fatent);
+		if (err)
+			return err;
+
+		do {
+			if (bits != 12 && !fat_find_free_w(fatent, end, bits))
+				break;
+			if (fat_get_w(fatent, bits) == FAT_ENT_FREE) {
+				err = fat_trim_add(st, fatent->entry, 1);
+				if (err)
+					return err;
+			}
+		} while (fat_next_w(sbi, fatent, bits) &&
+			 fatent->entry < end);
+	}
+	return 0;
+}
+
+static int fat_trim_scan_fat(struct fat_trim_state *st,
+			     struct fat_entry *fatent, int start, int end)
+{
+	return FAT_DISPATCH(MSDOS_SB(st->sb), __fat_trim_scan_fat, st, fatent,
+			    start, end);
+}
+
+static void fat_trim_reada(struct super_block *sb, struct fat_entry *fatent,
+			   int entry)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	unsigned long reada_blocks = FAT_READA_SIZE >> sb->s_blocksize_bits;
+	sector_t blocknr;
+	int offset;
+
+	sbi->fatent_ops->ent_blocknr(sb, entry, &offset, &blocknr);
+	fatent_set_entry(fatent, entry);
+	fat_ent_reada(sb, fatent, min_t(unsigned long, reada_blocks,
+		      sbi->fat_start + sbi->fat_length - blocknr));
+}
+
+int fat_trim_fs(struct inode *inode, struct fstrim_range *range)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_trim_state st;
+	struct fat_entry fatent;
+	unsigned long *trim_clean, group, reada_next;
+	unsigned long ent_per_reada;
+	u64 ent_start, ent_end;
+	int err = 0;
+
+	/*
+	 * FAT data is organized as clusters, trim at the granularity of
+	 * cluster. fstrim_range is in byte, convert the values to cluster
+	 * index. The sectors before the data region are treated as used.
+	 */
+	ent_start = max_t(u64, range->start >> sbi->cluster_bits,
+			  FAT_START_ENT);
+	ent_end = ent_start + (range->len >> sbi->cluster_bits);
+	if (ent_start >= sbi->max_cluster || range->len < sbi->cluster_size)
+		return -EINVAL;
+	if (ent_end > sbi->max_cluster)
+		ent_end = sbi->max_cluster;
+
+	if (!sbi->trim_clean) {
+		trim_clean = kvzalloc(BITS_TO_LONGS(DIV_ROUND_UP(
+				sbi->max_cluster, FAT_TRIM_GROUP)) *
+				sizeof(long), GFP_KERNEL);
+		if (!trim_clean)
+			return -ENOMEM;
+		if (cmpxchg(&sbi->trim_clean, NULL, trim_clean))
+			kvfree(trim_clean);
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.sb = sb;
+	st.minlen = max_t(u64, range->minlen >> sbi->cluster_bits, 1);
+
+	ent_per_reada = (FAT_READA_SIZE * 8) / sbi->fat_bits;
+	reada_next = ent_start;
+
+	fatent_init(&fatent);
+	lock_fat(sbi);
+	for (group = ent_start / FAT_TRIM_GROUP;
+	     group * FAT_TRIM_GROUP < ent_end; group++) {
+		u64 start = max_t(u64, group * FAT_TRIM_GROUP, ent_start);
+		u64 end = min_t(u64, (group + 1) * FAT_TRIM_GROUP, ent_end);
+		/* the first and last groups may be covered only partially */
+		int whole = (start == group * FAT_TRIM_GROUP || start ==
+			     FAT_START_ENT) && (end == (group + 1) *
+			     FAT_TRIM_GROUP || end == sbi->max_cluster);
+
+		if (whole && test_bit(group, sbi->trim_clean)) {
+			/* nothing was freed since the last trim */
+			err = fat_trim_flush(&st);
+			if (err)
+				break;
+			continue;
+		}
+
+		st.skipped = false;
+		if (sbi->free_map_valid) {
+			err = fat_trim_scan_map(&st, start, end);
+		} else {
+			if (start >= reada_next) {
+				fat_trim_reada(sb, &fatent, start);
+				reada_next = start + ent_per_reada;
+			}
+			err = fat_trim_scan_fat(&st, &fatent, start, end);
+		}
+		if (err)
+			break;
+		if (whole)
+			fat_trim_group_done(&st, group);
+
+		if (fatal_signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		if (need_resched()) {
+			/* the run may be allocated while we don't hold lock */
+			err = fat_trim_flush(&st);
+			if (err)
+				break;
+			fatent_brelse(&fatent);
+			unlock_fat(sbi);
+			cond_resched();
+			lock_fat(sbi);
+		}
+	}
+	/* handle the tail entries which are all free */
+	if (!err)
+		err = fat_trim_flush(&st);
+	unlock_fat(sbi);
+	fatent_brelse(&fatent);
+
+	range->len = st.trimmed << sbi->cluster_bits;
+	/* the device may not support discard */
+	return err == -EOPNOTSUPP && st.trimmed ? 0 : err;
+}
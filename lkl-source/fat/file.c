@@ -121,6 +121,341 @@ static int fat_ioctl_get_volume_id(struct inode *inode, u32 __user *user_attr)
 	return put_user(sbi->vol_id, user_attr);
 }
 
+static int fat_ioctl_fitrim(struct inode *inode, unsigned long arg)
+{
+	struct super_block *sb = inode->i_sb;
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	struct fstrim_range __user *user_range;
+	struct fstrim_range range;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (!blk_queue_discard(q))
+		return -EOPNOTSUPP;
+
+	user_range = (struct fstrim_range __user *)arg;
+	if (copy_from_user(&range, user_range, sizeof(range)))
+		return -EFAULT;
+
+	range.minlen = max_t(unsigned int, range.minlen,
+			     q->limits.discard_granularity);
+
+	err = fat_trim_fs(inode, &range);
+	if (err < 0)
+		return err;
+
+	if (copy_to_user(user_range, &range, sizeof(range)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* Counts the clusters and the fragments of the cluster chain of inode */
+static int fat_chain_extents(struct inode *inode, int *nr_clus, int *nr_frags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct fat_entry fatent;
+	int cluster = MSDOS_I(inode)->i_start, prev = 0, err = 0;
+
+	*nr_clus = *nr_frags = 0;
+	if (!cluster)
+		return 0;
+
+	fatent_init(&fatent);
+	while (cluster != FAT_ENT_EOF) {
+		if (cluster != prev + 1)
+			(*nr_frags)++;
+		prev = cluster;
+		if (++(*nr_clus) > MSDOS_SB(sb)->max_cluster) {
+			fat_fs_error(sb, "%s: detected the cluster chain loop"
+				     " (i_pos %lld)", __func__,
+				     MSDOS_I(inode)->i_pos);
+			err = -EIO;
+			break;
+		}
+		cluster = fat_ent_read(inode, &fatent, cluster);
+		if (cluster < 0) {
+			err = cluster;
+			break;
+		} else if (cluster == FAT_ENT_FREE) {
+			fat_fs_error(sb, "%s: invalid cluster chain (i_pos %lld)",
+				     __func__, MSDOS_I(inode)->i_pos);
+			err = -EIO;
+			break;
+		}
+	}
+	fatent_brelse(&fatent);
+	return err;
+}
+
+/*
+ * Copies the data of a regular file to the new run through its page
+ * cache, so that the copy sees the same data as read() does.
+ */
+static int fat_defrag_copy_file(struct inode *inode, int new_start,
+				int nr_clus)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct address_space *mapping = inode->i_mapping;
+	sector_t blknr = fat_clus_to_blknr(sbi, new_start);
+	struct page *page = NULL;
+	struct buffer_head *bh;
+	loff_t pos, size;
+	char *kaddr;
+	int err = 0;
+
+	/* The initialized area beyond i_size has to be copied as well */
+	size = max_t(loff_t, i_size_read(inode), MSDOS_I(inode)->mmu_private);
+	size = min_t(loff_t, size, (loff_t)nr_clus << sbi->cluster_bits);
+
+	for (pos = 0; pos < size; pos += sb->s_blocksize, blknr++) {
+		pgoff_t index = pos >> PAGE_SHIFT;
+
+		if (!page || page->index != index) {
+			if (page)
+				put_page(page);
+			page = read_mapping_page(mapping, index, NULL);
+			if (IS_ERR(page)) {
+				err = PTR_ERR(page);
+				page = NULL;
+				break;
+			}
+		}
+
+		bh = sb_getblk(sb, blknr);
+		if (!bh) {
+			err = -ENOMEM;
+			break;
+		}
+		lock_buffer(bh);
+		kaddr = kmap_atomic(page);
+		memcpy(bh->b_data, kaddr + offset_in_page(pos),
+		       sb->s_blocksize);
+		kunmap_atomic(kaddr);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	if (page)
+		put_page(page);
+	return err;
+}
+
+/* Moves the directory entries, and the child inodes which use them */
+static void fat_defrag_move_dir(struct inode *dir, struct buffer_head **from,
+				struct buffer_head **to, int nr_blocks)
+{
+	int i;
+
+	for (i = 0; i < nr_blocks; i++) {
+		lock_buffer(to[i]);
+		fat_move_dir_block(dir->i_sb, from[i], to[i]);
+		set_buffer_uptodate(to[i]);
+		unlock_buffer(to[i]);
+		mark_buffer_dirty_inode(to[i], dir);
+	}
+}
+
+/*
+ * Copies a directory to the new run through the buffer cache. All the
+ * blocks are read, and the copy is written out, before the child inodes
+ * are switched to the new blocks. They are switched back if the new
+ * blocks can't be written again after that, so that the old chain stays
+ * the good copy until it is no longer used.
+ */
+static int fat_defrag_copy_dir(struct inode *dir, int new_start, int nr_clus)
+{
+	struct super_block *sb = dir->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	sector_t blknr, new_blknr = fat_clus_to_blknr(sbi, new_start);
+	int i, nr_blocks = nr_clus * sbi->sec_per_clus, err = 0;
+	struct buffer_head **old, **new;
+	unsigned long mapped_blocks;
+
+	old = kvmalloc_array(nr_blocks * 2, sizeof(*old),
+			     GFP_NOFS | __GFP_ZERO);
+	if (!old)
+		return -ENOMEM;
+	new = old + nr_blocks;
+
+	for (i = 0; i < nr_blocks; i++) {
+		err = fat_bmap(dir, i, &blknr, &mapped_blocks, 0, false);
+		if (!err && !blknr)
+			err = -EIO;
+		if (err)
+			goto out;
+		old[i] = sb_bread(sb, blknr);
+		new[i] = sb_getblk(sb, new_blknr + i);
+		if (!old[i] || !new[i]) {
+			err = -EIO;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr_blocks; i++) {
+		lock_buffer(new[i]);
+		memcpy(new[i]->b_data, old[i]->b_data, sb->s_blocksize);
+		set_buffer_uptodate(new[i]);
+		unlock_buffer(new[i]);
+		mark_buffer_dirty(new[i]);
+	}
+	err = fat_sync_bhs(new, nr_blocks);
+	if (err)
+		goto out;
+
+	/* The entries may have changed since the copy, this copies them again */
+	fat_defrag_move_dir(dir, old, new, nr_blocks);
+	err = fat_sync_bhs(new, nr_blocks);
+	if (err)
+		fat_defrag_move_dir(dir, new, old, nr_blocks);
+	else
+		/* The decoded records have the i_pos of the children */
+		fat_dindex_drop(dir);
+out:
+	for (i = 0; i < nr_blocks; i++) {
+		brelse(old[i]);
+		brelse(new[i]);
+	}
+	kvfree(old);
+	return err;
+}
+
+/*
+ * Moves the cluster chain of inode into a contiguous run. The new chain
+ * is written out before the directory entry is switched to it, and the
+ * old chain is freed only after that, so a crash leaves either chain
+ * intact (and at worst some lost clusters).
+ */
+static int fat_defrag_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct address_space *mapping = inode->i_mapping;
+	int is_dir = S_ISDIR(inode->i_mode);
+	int nr_clus, nr_frags, old_start, new_start, err;
+	sector_t blknr;
+	loff_t i_pos;
+
+	/* Unlinked, it's going away anyway */
+	if (!fat_i_pos_read(sbi, inode))
+		return -ENOENT;
+
+	err = fat_chain_extents(inode, &nr_clus, &nr_frags);
+	if (err || nr_frags <= 1)
+		return err;
+
+	if (!is_dir) {
+		/* The pages of a shared writable mapping can't be moved */
+		if (mapping_writably_mapped(mapping))
+			return -EBUSY;
+		err = filemap_write_and_wait(mapping);
+		if (err)
+			return err;
+	}
+
+	err = fat_alloc_contig(inode, &new_start, nr_clus);
+	if (err)
+		return err;
+
+	if (is_dir)
+		err = fat_defrag_copy_dir(inode, new_start, nr_clus);
+	else
+		err = fat_defrag_copy_file(inode, new_start, nr_clus);
+	if (err)
+		goto out_free;
+
+	/* fat_defrag_copy_dir() has written the copy of a directory */
+	if (!is_dir) {
+		blknr = fat_clus_to_blknr(sbi, new_start);
+		err = filemap_write_and_wait_range(
+				sb->s_bdev->bd_inode->i_mapping,
+				(loff_t)blknr << sb->s_blocksize_bits,
+				((loff_t)(blknr + nr_clus * sbi->sec_per_clus)
+				 << sb->s_blocksize_bits) - 1);
+		if (err)
+			goto out_free;
+	}
+
+	/* Switch to the new chain */
+	down_write(&MSDOS_I(inode)->truncate_lock);
+	old_start = MSDOS_I(inode)->i_start;
+	i_pos = fat_i_pos_read(sbi, inode);
+	fat_detach(inode);
+	MSDOS_I(inode)->i_start = new_start;
+	MSDOS_I(inode)->i_logstart = new_start;
+	fat_attach(inode, i_pos);
+	fat_cache_inval_inode(inode);
+	/* The clean pages still have buffers mapped to the old chain */
+	if (!is_dir)
+		truncate_inode_pages(mapping, 0);
+	up_write(&MSDOS_I(inode)->truncate_lock);
+
+	err = fat_sync_inode(inode);
+	if (err)
+		return err;	/* keep the old chain, it may still be used */
+	if (is_dir) {
+		err = fat_dir_relink(inode);
+		if (err)
+			return err;
+	} else {
+		inode_dio_wait(inode);
+		/*
+		 * The page cache readers don't take truncate_lock: a read may
+		 * have mapped its page through the old chain before the switch
+		 * and got it in the cache after the truncate above. Drop the
+		 * pages again, so none still maps the chain freed below.
+		 */
+		truncate_inode_pages(mapping, 0);
+	}
+
+	return fat_free_clusters(inode, old_start);
+
+out_free:
+	fat_free_clusters(inode, new_start);
+	return err;
+}
+
+static int fat_ioctl_defrag(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	int is_dir = S_ISDIR(inode->i_mode);
+	int err;
+
+	if (!inode_owner_or_capable(inode))
+		return -EPERM;
+
+	/* The root directory has no directory entry to switch */
+	if (inode->i_ino == MSDOS_ROOT_INO ||
+	    (!is_dir && !S_ISREG(inode->i_mode)))
+		return -EINVAL;
+
+	err = mnt_want_write_file(file);
+	if (err)
+		return err;
+
+	inode_lock(inode);
+	if (is_dir)
+		mutex_lock(&sbi->s_lock);
+	err = fat_defrag_inode(inode);
+	if (is_dir)
+		mutex_unlock(&sbi->s_lock);
+	inode_unlock(inode);
+
+	mnt_drop_write_file(file);
+	return err;
+}
+
 long fat_generic_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct inode *inode = file_inode(filp);
@@ -133,6 +468,10 @@ long fat_generic_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		return fat_ioctl_set_attributes(filp, user_attr);
 	case FAT_IOCTL_GET_VOLUME_ID:
 		return fat_ioctl_get_volume_id(inode, user_attr);
+	case FITRIM:
+		return fat_ioctl_fitrim(inode, arg);
+	case FAT_IOCTL_DEFRAG:
+		return fat_ioctl_defrag(filp);
 	default:
 		return -ENOTTY;	/* Inappropriate ioctl for device */
 	}
@@ -168,7 +507,10 @@ int fat_file_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
 	int res, err;
 
 	res = generic_file_fsync(filp, start, end, datasync);
-	err = sync_mapping_buffers(MSDOS_SB(inode->i_sb)->fat_inode->i_mapping);
+	err = fat_mirror_flush(inode->i_sb);
+	if (!err)
+		err = sync_mapping_buffers(
+			MSDOS_SB(inode->i_sb)->fat_inode->i_mapping);
 	
 	printk(KERN_INFO "fat_generic_compat_ioctl called");
 
@@ -266,12 +608,11 @@ static long fat_fallocate(struct file *file, int mode,
 		nr_cluster = (mm_bytes + (sbi->cluster_size - 1)) >>
 			sbi->cluster_bits;
 
-		/* Start the allocation.We are not zeroing out the clusters */
-		while (nr_cluster-- > 0) {
-			err = fat_add_cluster(inode);
-			if (err)
-				goto error;
-		}
+		/*
+		 * Start the allocation as one chain. We are not zeroing out
+		 * the clusters.
+		 */
+		err = fat_add_clusters(inode, nr_cluster);
 	} else {
 		if ((offset + len) <= i_size_read(inode))
 			goto error;
@@ -285,11 +626,15 @@ error:
 	return err;
 }
 
+/* Chains of this many clusters or more are freed in background */
+#define FAT_ASYNC_FREE_MIN	4096
+
 /* Free all clusters after the skip'th cluster. */
 static int fat_free(struct inode *inode, int skip)
 {
 	struct super_block *sb = inode->i_sb;
 	int err, wait, free_start, i_start, i_logstart;
+	unsigned long nr_clus;
 
 	if (MSDOS_I(inode)->i_start == 0)
 		return 0;
@@ -347,11 +692,17 @@ static int fat_free(struct inode *inode, int skip)
 		if (ret < 0)
 			return ret;
 
+		/* A walk in the meantime may have recorded the old EOF */
+		fat_cache_inval_inode(inode);
 		free_start = ret;
 	}
+	nr_clus = inode->i_blocks >> (MSDOS_SB(sb)->cluster_bits - 9);
 	inode->i_blocks = skip << (MSDOS_SB(sb)->cluster_bits - 9);
 
 	/* Freeing the remained cluster chain */
+	if (nr_clus >= skip + FAT_ASYNC_FREE_MIN &&
+	    !(sb->s_flags & MS_SYNCHRONOUS))
+		return fat_free_clusters_async(inode, free_start);
 	return fat_free_clusters(inode, free_start);
 }
 
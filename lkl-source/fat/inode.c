@@ -94,21 +94,26 @@ static struct fat_floppy_defaults {
 },
 };
 
-int fat_add_cluster(struct inode *inode)
+int fat_add_clusters(struct inode *inode, int nr_cluster)
 {
 	int err, cluster;
 
-	err = fat_alloc_clusters(inode, &cluster, 1);
+	err = fat_alloc_chain(inode, &cluster, nr_cluster);
 	if (err)
 		return err;
 	/* FIXME: this cluster should be added after data of this
 	 * cluster is writed */
-	err = fat_chain_add(inode, cluster, 1);
+	err = fat_chain_add(inode, cluster, nr_cluster);
 	if (err)
 		fat_free_clusters(inode, cluster);
 	return err;
 }
 
+int fat_add_cluster(struct inode *inode)
+{
+	return fat_add_clusters(inode, 1);
+}
+
 static inline int __fat_get_block(struct inode *inode, sector_t iblock,
 				  unsigned long *max_blocks,
 				  struct buffer_head *bh_result, int create)
@@ -453,6 +458,40 @@ void fat_detach(struct inode *inode)
 }
 EXPORT_SYMBOL_GPL(fat_detach);
 
+/*
+ * Copies the directory block "old" to "new" and moves the inodes whose
+ * entries live in it along. This is done under inode_hash_lock, so
+ * fat_write_inode() updates either the old block before the copy or the
+ * new block after it.
+ */
+void fat_move_dir_block(struct super_block *sb, struct buffer_head *old,
+			struct buffer_head *new)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	loff_t old_pos = (loff_t)old->b_blocknr << sbi->dir_per_block_bits;
+	loff_t new_pos = (loff_t)new->b_blocknr << sbi->dir_per_block_bits;
+	struct msdos_inode_info *i;
+	struct hlist_node *n;
+	int offset;
+
+	spin_lock(&sbi->inode_hash_lock);
+	memcpy(new->b_data, old->b_data, sb->s_blocksize);
+	for (offset = 0; offset < sbi->dir_per_block; offset++) {
+		struct hlist_head *head =   sbi->inode_hashtable
+					  + fat_hash(old_pos + offset);
+
+		hlist_for_each_entry_safe(i, n, head, i_fat_hash) {
+			if (i->i_pos != old_pos + offset)
+				continue;
+			i->i_pos = new_pos + offset;
+			hlist_del(&i->i_fat_hash);
+			hlist_add_head(&i->i_fat_hash, sbi->inode_hashtable
+				       + fat_hash(i->i_pos));
+		}
+	}
+	spin_unlock(&sbi->inode_hash_lock);
+}
+
 struct inode *fat_iget(struct super_block *sb, loff_t i_pos)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
@@ -622,6 +661,7 @@ struct inode *fat_build_inode(struct super_block *sb,
 		goto out;
 	}
 	fat_attach(inode, i_pos);
+	fat_map_snap_restore(inode);
 	insert_inode_hash(inode);
 out:
 	fat_unlock_build_inode(MSDOS_SB(sb));
@@ -669,7 +709,13 @@ static void fat_evict_inode(struct inode *inode)
 
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
+	if (inode->i_nlink)
+		fat_map_snap_save(inode);
 	fat_cache_inval_inode(inode);
+	fat_dindex_drop(inode);
+	fat_dbloom_drop(inode);
+	fat_dholes_drop(inode);
+	fat_dalias_drop(inode);
 	fat_detach(inode);
 	
 	printk(KERN_INFO "fat_evict_inode called");
@@ -740,6 +786,10 @@ static void fat_set_state(struct super_block *sb,
 static void delayed_free(struct rcu_head *p)
 {
 	struct msdos_sb_info *sbi = container_of(p, struct msdos_sb_info, rcu);
+	kvfree(sbi->free_map);
+	kvfree(sbi->mirror_dirty);
+	kvfree(sbi->trim_clean);
+	kfree(sbi->alloc_groups);
 	unload_nls(sbi->nls_disk);
 	unload_nls(sbi->nls_io);
 	if (sbi->options.iocharset != fat_default_iocharset)
@@ -751,6 +801,14 @@ static void fat_put_super(struct super_block *sb)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 
+	/*
+	 * The inodes evicted at umount may have left orphans. The worker may
+	 * be queued again even when the list is already empty, so always
+	 * wait for it before sbi goes away.
+	 */
+	flush_work(&sbi->orphan_work);
+	fat_mirror_flush(sb);
+	fat_map_snap_release(sb);
 	fat_set_state(sb, 0, 0);
 
 	iput(sbi->fsinfo_inode);
@@ -772,6 +830,8 @@ static struct inode *fat_alloc_inode(struct super_block *sb)
 		return NULL;
 
 	init_rwsem(&ei->truncate_lock);
+	ei->i_alloc_goal = 0;
+	ei->i_dir_ra = 0;
 	
 	printk(KERN_INFO "fat_alloc_inode called");
 	
@@ -795,9 +855,20 @@ static void init_once(void *foo)
 	struct msdos_inode_info *ei = (struct msdos_inode_info *)foo;
 
 	spin_lock_init(&ei->cache_lru_lock);
+	seqcount_init(&ei->cache_seq);
 	ei->nr_caches = 0;
+	ei->max_caches = FAT_MAX_CACHE;
+	ei->nr_misses = 0;
+	INIT_LIST_HEAD(&ei->cache_grown);
 	ei->cache_valid_id = FAT_CACHE_VALID + 1;
 	INIT_LIST_HEAD(&ei->cache_lru);
+	ei->i_extents = RB_ROOT;
+	ei->i_tail_dclus = 0;
+	ei->i_dindex = NULL;
+	ei->i_dbloom = NULL;
+	ei->i_dholes = NULL;
+	ei->i_daliases = NULL;
+	ei->i_dir_ra = 0;
 	INIT_HLIST_NODE(&ei->i_fat_hash);
 	INIT_HLIST_NODE(&ei->i_dir_hash);
 	inode_init_once(&ei->vfs_inode);
@@ -942,6 +1013,8 @@ static int fat_write_inode(struct inode *inode, struct writeback_control *wbc)
 		mutex_lock(&MSDOS_SB(sb)->s_lock);
 		err = fat_clusters_flush(sb);
 		mutex_unlock(&MSDOS_SB(sb)->s_lock);
+		if (!err)
+			err = fat_mirror_flush(sb);
 	} else
 		err = __fat_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
 
@@ -957,6 +1030,13 @@ int fat_sync_inode(struct inode *inode)
 
 EXPORT_SYMBOL_GPL(fat_sync_inode);
 
+static int fat_sync_fs(struct super_block *sb, int wait)
+{
+	if (wait)
+		fat_orphan_drain(sb);
+	return fat_mirror_flush(sb);
+}
+
 static int fat_show_options(struct seq_file *m, struct dentry *root);
 static const struct super_operations fat_sops = {						//The methods that need printk based on question 1
 	.alloc_inode	= fat_alloc_inode,
@@ -964,6 +1044,7 @@ static const struct super_operations fat_sops = {						//The methods that need p
 	.write_inode	= fat_write_inode,
 	.evict_inode	= fat_evict_inode,
 	.put_super	= fat_put_super,
+	.sync_fs	= fat_sync_fs,
 	.statfs		= fat_statfs,
 	.remount_fs	= fat_remount,
 
@@ -1058,6 +1139,14 @@ static int fat_show_options(struct seq_file *m, struct dentry *root)
 		seq_puts(m, ",discard");
 	if (opts->dos1xfloppy)
 		seq_puts(m, ",dos1xfloppy");
+	if (opts->free_map)
+		seq_puts(m, ",freemap");
+	if (opts->lazy_mirror)
+		seq_puts(m, ",lazymirror");
+	if (opts->extent_map)
+		seq_puts(m, ",extentmap");
+	if (opts->map_snap)
+		seq_puts(m, ",mapsnap");
 
 	printk(KERN_INFO "fat_show_options called");
 
@@ -1075,6 +1164,7 @@ enum {
 	Opt_obsolete, Opt_flush, Opt_tz_utc, Opt_rodir, Opt_err_cont,
 	Opt_err_panic, Opt_err_ro, Opt_discard, Opt_nfs, Opt_time_offset,
 	Opt_nfs_stale_rw, Opt_nfs_nostale_ro, Opt_err, Opt_dos1xfloppy,
+	Opt_free_map, Opt_lazy_mirror, Opt_extent_map, Opt_map_snap,
 };
 
 static const match_table_t fat_tokens = {
@@ -1108,6 +1198,10 @@ static const match_table_t fat_tokens = {
 	{Opt_nfs_stale_rw, "nfs=stale_rw"},
 	{Opt_nfs_nostale_ro, "nfs=nostale_ro"},
 	{Opt_dos1xfloppy, "dos1xfloppy"},
+	{Opt_free_map, "freemap"},
+	{Opt_lazy_mirror, "lazymirror"},
+	{Opt_extent_map, "extentmap"},
+	{Opt_map_snap, "mapsnap"},
 	{Opt_obsolete, "conv=binary"},
 	{Opt_obsolete, "conv=text"},
 	{Opt_obsolete, "conv=auto"},
@@ -1320,6 +1414,20 @@ static int parse_options(struct super_block *sb, char *options, int is_vfat,
 		case Opt_dos1xfloppy:
 			opts->dos1xfloppy = 1;
 			break;
+		case Opt_free_map:
+			opts->free_map = 1;
+			break;
+		case Opt_lazy_mirror:
+			opts->lazy_mirror = 1;
+			break;
+		case Opt_extent_map:
+			opts->extent_map = 1;
+			break;
+		case Opt_map_snap:
+			/* what it keeps are the extent maps */
+			opts->extent_map = 1;
+			opts->map_snap = 1;
+			break;
 
 		/* msdos specific */
 		case Opt_dots:
@@ -1859,10 +1967,32 @@ int fat_fill_super(struct super_block *sb, void *data, int silent, int isvfat,
 	if (sbi->prev_free < FAT_START_ENT)
 		sbi->prev_free = FAT_START_ENT;
 
+	if (sbi->options.free_map) {
+		sbi->free_map = kvzalloc(BITS_TO_LONGS(sbi->max_cluster) *
+					 sizeof(long), GFP_KERNEL);
+		if (!sbi->free_map) {
+			fat_msg(sb, KERN_WARNING, "not enough memory for "
+			       "the free cluster map, disabling \"freemap\"");
+			sbi->options.free_map = 0;
+		}
+	}
+
+	if (sbi->options.lazy_mirror && sbi->fats > 1) {
+		sbi->mirror_dirty = kvzalloc(BITS_TO_LONGS(sbi->fat_length) *
+					     sizeof(long), GFP_KERNEL);
+		if (!sbi->mirror_dirty) {
+			fat_msg(sb, KERN_WARNING, "not enough memory for "
+			       "deferred FAT mirroring, disabling \"lazymirror\"");
+			sbi->options.lazy_mirror = 0;
+		}
+	}
+
 	/* set up enough so that it can read an inode */
 	fat_hash_init(sb);
 	dir_hash_init(sb);
-	fat_ent_access_init(sb);
+	error = fat_ent_access_init(sb);
+	if (error)
+		goto out_fail;
 
 	/*
 	 * The low byte of FAT's first entry must have same value with
@@ -1888,6 +2018,7 @@ int fat_fill_super(struct super_block *sb, void *data, int silent, int isvfat,
 			       sbi->options.iocharset);
 			goto out_fail;
 		}
+		fat_init_name_fold(sbi);
 	}
 	
 	_method_bits_length(sbi,total_clusters);
@@ -1934,6 +2065,11 @@ int fat_fill_super(struct super_block *sb, void *data, int silent, int isvfat,
 					"the device does not support discard");
 	}
 
+	/* Build the free cluster map now, not at the first allocation */
+	if (sbi->free_map && fat_count_free_clusters(sb))
+		fat_msg(sb, KERN_WARNING, "failed to build the free cluster map");
+
+	fat_map_snap_init(sb);
 	fat_set_state(sb, 1, 0);
 	return 0;
 
@@ -1951,6 +2087,9 @@ out_fail:
 	unload_nls(sbi->nls_disk);
 	if (sbi->options.iocharset != fat_default_iocharset)
 		kfree(sbi->options.iocharset);
+	kvfree(sbi->free_map);
+	kvfree(sbi->mirror_dirty);
+	kfree(sbi->alloc_groups);
 	sb->s_fs_info = NULL;
 	kfree(sbi);
 	return error;
@@ -2012,12 +2151,18 @@ static int __init init_fat_fs(void)
 	if (err)
 		return err;
 
-	err = fat_init_inodecache();
+	err = fat_dindex_init();
 	if (err)
 		goto failed;
 
+	err = fat_init_inodecache();
+	if (err)
+		goto failed_dindex;
+
 	return 0;
 
+failed_dindex:
+	fat_dindex_destroy();
 failed:
 	fat_cache_destroy();
 	return err;
@@ -2026,6 +2171,7 @@ failed:
 static void __exit exit_fat_fs(void)
 {
 	fat_cache_destroy();
+	fat_dindex_destroy();
 	fat_destroy_inodecache();
 }
 
@@ -0,0 +1,478 @@
+/*
+ *  linux/fs/fat/mapsnap.c
+ *
+ *  Snapshot of the extent maps, kept across mounts ("mapsnap" option).
+ *
+ *  The extent maps of the evicted inodes which mapped the most clusters
+ *  are kept in sbi->map_snap, and given back to the inode when it is read
+ *  in again. At unmount, what is left is written to a file next to the
+ *  journal, each inode with the crc32 of the FAT blocks its runs cover.
+ *  The next mount takes back the inodes whose part of the FAT is still
+ *  the same, so the first pass over big files doesn't have to walk the
+ *  FAT again.
+ */
+
+#include <linux/slab.h>
+#include <linux/crc32.h>
+#include "fat.h"
+
+#define FAT_SNAP_MAGIC		0x50534d46	/* "FMSP" */
+#define FAT_SNAP_MAX_INODES	256
+#define FAT_SNAP_MAX_RUNS	4096		/* per inode */
+#define FAT_SNAP_BUF_RUNS	256
+
+struct fat_snap_inode {
+	struct hlist_node hash;		/* hash by i_pos */
+	loff_t i_pos;
+	int i_start;
+	int nr_runs;
+	unsigned long clusters;		/* mapped by the runs */
+	struct fat_map_run runs[];
+};
+
+struct fat_map_snap {
+	spinlock_t lock;
+	int nr_inodes;
+	struct hlist_head hash[FAT_HASH_SIZE];
+};
+
+/*
+ * The file is a header, a record with its runs for each inode, and the
+ * crc32 of all that.
+ */
+struct fat_snap_header {
+	__le32 magic;
+	__le32 nr_inodes;
+};
+
+struct fat_snap_record {
+	__le64 i_pos;
+	__le32 i_start;
+	__le32 nr_runs;
+	__le32 fat_crc;		/* crc32 of the FAT blocks the runs cover */
+};
+
+struct fat_snap_run {
+	__le32 fcluster;
+	__le32 dcluster;
+	__le32 nr_contig;
+};
+
+static inline struct hlist_head *fat_snap_hash(struct fat_map_snap *snap,
+					       loff_t i_pos)
+{
+	return &snap->hash[hash_32(i_pos, FAT_HASH_BITS)];
+}
+
+static struct fat_snap_inode *__fat_snap_find(struct fat_map_snap *snap,
+					      loff_t i_pos)
+{
+	struct fat_snap_inode *si;
+
+	hlist_for_each_entry(si, fat_snap_hash(snap, i_pos), hash) {
+		if (si->i_pos == i_pos)
+			return si;
+	}
+	return NULL;
+}
+
+/* Keeps "si", unless there are enough inodes which mapped more */
+static void fat_snap_insert(struct fat_map_snap *snap,
+			    struct fat_snap_inode *si)
+{
+	struct fat_snap_inode *old, *victim = NULL, *p;
+	int i;
+
+	spin_lock(&snap->lock);
+	old = __fat_snap_find(snap, si->i_pos);
+	if (old) {
+		hlist_del(&old->hash);
+		snap->nr_inodes--;
+	}
+	if (snap->nr_inodes >= FAT_SNAP_MAX_INODES) {
+		for (i = 0; i < FAT_HASH_SIZE; i++) {
+			hlist_for_each_entry(p, &snap->hash[i], hash) {
+				if (!victim || p->clusters < victim->clusters)
+					victim = p;
+			}
+		}
+		if (victim->clusters >= si->clusters) {
+			victim = si;
+			goto out;
+		}
+		hlist_del(&victim->hash);
+		snap->nr_inodes--;
+	}
+	hlist_add_head(&si->hash, fat_snap_hash(snap, si->i_pos));
+	snap->nr_inodes++;
+out:
+	spin_unlock(&snap->lock);
+	kfree(old);
+	kfree(victim);
+}
+
+/* Called at eviction, while the extent map is still there */
+void fat_map_snap_save(struct inode *inode)
+{
+	struct fat_map_snap *snap = MSDOS_SB(inode->i_sb)->map_snap;
+	struct fat_snap_inode *si;
+	int i, nr;
+
+	if (!snap || !MSDOS_I(inode)->i_start || !MSDOS_I(inode)->i_pos)
+		return;
+	nr = fat_cache_get_extents(inode, NULL, 0);
+	if (!nr)
+		return;
+	nr = min(nr, FAT_SNAP_MAX_RUNS);
+
+	si = kmalloc(sizeof(*si) + nr * sizeof(si->runs[0]), GFP_NOFS);
+	if (!si)
+		return;
+	si->i_pos = MSDOS_I(inode)->i_pos;
+	si->i_start = MSDOS_I(inode)->i_start;
+	si->nr_runs = min(nr, fat_cache_get_extents(inode, si->runs, nr));
+	si->clusters = 0;
+	for (i = 0; i < si->nr_runs; i++)
+		si->clusters += si->runs[i].nr_contig + 1;
+	fat_snap_insert(snap, si);
+}
+
+/* Called when the inode is read in, before anyone can look it up */
+void fat_map_snap_restore(struct inode *inode)
+{
+	struct fat_map_snap *snap = MSDOS_SB(inode->i_sb)->map_snap;
+	struct fat_snap_inode *si;
+	int i;
+
+	if (!snap)
+		return;
+
+	spin_lock(&snap->lock);
+	si = __fat_snap_find(snap, MSDOS_I(inode)->i_pos);
+	if (si) {
+		hlist_del(&si->hash);
+		snap->nr_inodes--;
+	}
+	spin_unlock(&snap->lock);
+	if (!si)
+		return;
+
+	/* The entry may have been reused for another chain */
+	if (si->i_start == MSDOS_I(inode)->i_start) {
+		for (i = 0; i < si->nr_runs; i++)
+			fat_cache_set_extent(inode, &si->runs[i]);
+	}
+	kfree(si);
+}
+
+/* The block of the first FAT which holds the "last" byte of "entry" */
+static sector_t fat_snap_ent_block(struct super_block *sb, int entry,
+				   int last)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	u64 bytes;
+
+	/* a FAT12 entry may straddle two blocks */
+	if (sbi->fat_bits == 12)
+		bytes = entry + (entry >> 1) + last;
+	else
+		bytes = ((u64)entry << sbi->fatent_shift) +
+			(last ? (1 << sbi->fatent_shift) - 1 : 0);
+	return sbi->fat_start + (bytes >> sb->s_blocksize_bits);
+}
+
+/*
+ * The crc32 of the FAT blocks which hold the entries of the runs, so a
+ * change to the chain of the inode is seen without reading all the FAT.
+ */
+static int fat_snap_runs_crc(struct super_block *sb,
+			     struct fat_snap_inode *si, u32 *crc)
+{
+	struct buffer_head *bh;
+	sector_t blocknr, end;
+	int i;
+
+	*crc = ~0;
+	for (i = 0; i < si->nr_runs; i++) {
+		struct fat_map_run *run = &si->runs[i];
+
+		blocknr = fat_snap_ent_block(sb, run->dcluster, 0);
+		end = fat_snap_ent_block(sb, run->dcluster + run->nr_contig, 1);
+		for (; blocknr <= end; blocknr++) {
+			bh = sb_bread(sb, blocknr);
+			if (!bh)
+				return -EIO;
+			*crc = crc32_le(*crc, bh->b_data, sb->s_blocksize);
+			brelse(bh);
+		}
+	}
+	return 0;
+}
+
+static void fat_snap_name(struct super_block *sb, char *name)
+{
+	sprintf(name, "mapsnap-%08x", MSDOS_SB(sb)->vol_id);
+}
+
+static int fat_snap_write(int fd, const void *buf, size_t len, u32 *crc)
+{
+	if (sys_write(fd, buf, len) != (long)len)
+		return -EIO;
+	*crc = crc32_le(*crc, buf, len);
+	return 0;
+}
+
+static int fat_snap_read(int fd, void *buf, size_t len, u32 *crc)
+{
+	if (sys_read(fd, buf, len) != (long)len)
+		return -EIO;
+	*crc = crc32_le(*crc, buf, len);
+	return 0;
+}
+
+static int fat_snap_write_inode(struct super_block *sb, int fd,
+				struct fat_snap_inode *si,
+				struct fat_snap_run *buf, u32 *crc)
+{
+	struct fat_snap_record rec;
+	u32 fat_crc;
+	int i, n, err;
+
+	err = fat_snap_runs_crc(sb, si, &fat_crc);
+	if (err)
+		return err;
+	rec.i_pos = cpu_to_le64(si->i_pos);
+	rec.i_start = cpu_to_le32(si->i_start);
+	rec.nr_runs = cpu_to_le32(si->nr_runs);
+	rec.fat_crc = cpu_to_le32(fat_crc);
+	err = fat_snap_write(fd, &rec, sizeof(rec), crc);
+
+	for (i = 0; !err && i < si->nr_runs; i += n) {
+		for (n = 0; n < FAT_SNAP_BUF_RUNS && i + n < si->nr_runs; n++) {
+			buf[n].fcluster = cpu_to_le32(si->runs[i + n].fcluster);
+			buf[n].dcluster = cpu_to_le32(si->runs[i + n].dcluster);
+			buf[n].nr_contig = cpu_to_le32(si->runs[i + n].nr_contig);
+		}
+		err = fat_snap_write(fd, buf, n * sizeof(*buf), crc);
+	}
+	return err;
+}
+
+static int fat_snap_write_file(struct super_block *sb)
+{
+	struct fat_map_snap *snap = MSDOS_SB(sb)->map_snap;
+	struct fat_snap_header hdr;
+	struct fat_snap_inode *si;
+	struct fat_snap_run *buf;
+	char name[32];
+	u32 crc = ~0;
+	int fd, i, err;
+
+	buf = kmalloc(FAT_SNAP_BUF_RUNS * sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	fat_snap_name(sb, name);
+	fd = sys_open(name, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR);
+	if (fd < 0) {
+		kfree(buf);
+		return fd;
+	}
+
+	hdr.magic = cpu_to_le32(FAT_SNAP_MAGIC);
+	hdr.nr_inodes = cpu_to_le32(snap->nr_inodes);
+	err = fat_snap_write(fd, &hdr, sizeof(hdr), &crc);
+	for (i = 0; !err && i < FAT_HASH_SIZE; i++) {
+		hlist_for_each_entry(si, &snap->hash[i], hash) {
+			err = fat_snap_write_inode(sb, fd, si, buf, &crc);
+			if (err)
+				break;
+		}
+	}
+	if (!err) {
+		__le32 tail = cpu_to_le32(crc);
+
+		if (sys_write(fd, (char *)&tail, sizeof(tail)) != sizeof(tail))
+			err = -EIO;
+	}
+	if (!err)
+		err = sys_fsync(fd);
+	sys_close(fd);
+	kfree(buf);
+	return err;
+}
+
+static int fat_snap_read_inode(struct super_block *sb, int fd,
+			       struct fat_snap_run *buf, u32 *crc,
+			       struct fat_snap_inode **sip)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_snap_record rec;
+	struct fat_snap_inode *si;
+	u32 fat_crc;
+	int i, j, n, nr_runs, err;
+
+	err = fat_snap_read(fd, &rec, sizeof(rec), crc);
+	if (err)
+		return err;
+	nr_runs = le32_to_cpu(rec.nr_runs);
+	if (nr_runs <= 0 || nr_runs > FAT_SNAP_MAX_RUNS)
+		return -EINVAL;
+
+	si = kmalloc(sizeof(*si) + nr_runs * sizeof(si->runs[0]), GFP_KERNEL);
+	if (!si)
+		return -ENOMEM;
+	si->i_pos = le64_to_cpu(rec.i_pos);
+	si->i_start = le32_to_cpu(rec.i_start);
+	si->nr_runs = nr_runs;
+	si->clusters = 0;
+
+	for (i = 0; i < nr_runs; i += n) {
+		n = min(nr_runs - i, FAT_SNAP_BUF_RUNS);
+		err = fat_snap_read(fd, buf, n * sizeof(*buf), crc);
+		if (err)
+			goto error;
+		for (j = 0; j < n; j++) {
+			struct fat_map_run *run = &si->runs[i + j];
+
+			run->fcluster = le32_to_cpu(buf[j].fcluster);
+			run->dcluster = le32_to_cpu(buf[j].dcluster);
+			run->nr_contig = le32_to_cpu(buf[j].nr_contig);
+			/* the sums could overflow */
+			if (run->fcluster < 0 || run->nr_contig < 0 ||
+			    run->dcluster < FAT_START_ENT ||
+			    run->nr_contig >= sbi->max_cluster - run->dcluster ||
+			    run->fcluster >= sbi->max_cluster - run->nr_contig) {
+				err = -EINVAL;
+				goto error;
+			}
+			si->clusters += run->nr_contig + 1;
+		}
+	}
+	err = fat_snap_runs_crc(sb, si, &fat_crc);
+	if (err)
+		goto error;
+	/* the chain was changed since, but the next records may be fine */
+	if (le32_to_cpu(rec.fat_crc) != fat_crc) {
+		kfree(si);
+		si = NULL;
+	}
+	*sip = si;
+	return 0;
+
+error:
+	kfree(si);
+	return err;
+}
+
+static int fat_snap_read_file(struct super_block *sb)
+{
+	struct fat_map_snap *snap = MSDOS_SB(sb)->map_snap;
+	struct fat_snap_header hdr;
+	struct fat_snap_inode *si;
+	struct fat_snap_run *buf;
+	struct hlist_node *n;
+	char name[32];
+	u32 crc = ~0;
+	__le32 tail;
+	int fd, i, nr_inodes, err;
+
+	fat_snap_name(sb, name);
+	fd = sys_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return 0;	/* nothing saved yet */
+
+	err = -ENOMEM;
+	buf = kmalloc(FAT_SNAP_BUF_RUNS * sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		goto out;
+
+	err = fat_snap_read(fd, &hdr, sizeof(hdr), &crc);
+	if (err)
+		goto out;
+	nr_inodes = le32_to_cpu(hdr.nr_inodes);
+	err = -EINVAL;
+	if (le32_to_cpu(hdr.magic) != FAT_SNAP_MAGIC ||
+	    nr_inodes < 0 || nr_inodes > FAT_SNAP_MAX_INODES)
+		goto out;
+
+	for (i = 0; i < nr_inodes; i++) {
+		err = fat_snap_read_inode(sb, fd, buf, &crc, &si);
+		if (err)
+			goto out;
+		if (si)
+			fat_snap_insert(snap, si);
+	}
+	err = -EIO;
+	if (sys_read(fd, (char *)&tail, sizeof(tail)) != sizeof(tail))
+		goto out;
+	err = -EINVAL;
+	if (le32_to_cpu(tail) != crc)
+		goto out;
+	err = 0;
+out:
+	if (err) {
+		for (i = 0; i < FAT_HASH_SIZE; i++) {
+			hlist_for_each_entry_safe(si, n, &snap->hash[i], hash) {
+				hlist_del(&si->hash);
+				kfree(si);
+			}
+		}
+		snap->nr_inodes = 0;
+	}
+	sys_close(fd);
+	kfree(buf);
+	return err;
+}
+
+/* Called at mount, once the FAT can be read */
+void fat_map_snap_init(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_map_snap *snap;
+	int i, err;
+
+	if (!sbi->options.map_snap)
+		return;
+
+	snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap) {
+		fat_msg(sb, KERN_WARNING, "not enough memory for mapsnap");
+		return;
+	}
+	spin_lock_init(&snap->lock);
+	snap->nr_inodes = 0;
+	for (i = 0; i < FAT_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&snap->hash[i]);
+	sbi->map_snap = snap;
+
+	err = fat_snap_read_file(sb);
+	if (err)
+		fat_msg(sb, KERN_WARNING, "failed to read the extent map "
+			"snapshot (%d)", err);
+}
+
+/* Called at unmount, after all the inodes are evicted */
+void fat_map_snap_release(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_map_snap *snap = sbi->map_snap;
+	struct fat_snap_inode *si;
+	struct hlist_node *n;
+	int i, err;
+
+	if (!snap)
+		return;
+
+	err = fat_snap_write_file(sb);
+	if (err)
+		fat_msg(sb, KERN_WARNING, "failed to write the extent map "
+			"snapshot (%d)", err);
+
+	for (i = 0; i < FAT_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(si, n, &snap->hash[i], hash)
+			kfree(si);
+	}
+	kfree(snap);
+	sbi->map_snap = NULL;
+}
@@ -8,6 +8,8 @@
 
 #include "fat.h"
 #include <linux/syscalls.h>
+#include <linux/hash.h>
+#include <asm/unaligned.h>
 
 /*
  * fat_fs_error reports a file system problem that might indicate fa data
@@ -145,11 +147,6 @@ int fat_chain_add(struct inode *inode, int new_dclus, int nr_cluster)
 		}
 		if (ret < 0)
 			return ret;
-		/*
-		 * FIXME:Although we can add this cache, fat_cache_add() is
-		 * assuming to be called after linear search with fat_cache_id.
-		 */
-//		fat_cache_add(inode, new_fclus, new_dclus);
 	} else {
 		MSDOS_I(inode)->i_start = new_dclus;
 		MSDOS_I(inode)->i_logstart = new_dclus;
@@ -164,6 +161,8 @@ int fat_chain_add(struct inode *inode, int new_dclus, int nr_cluster)
 		} else
 			mark_inode_dirty(inode);
 	}
+	/* The next one finds the end of the chain without walking it */
+	fat_cache_append(inode, new_fclus, new_dclus, nr_cluster);
 	if (new_fclus != (inode->i_blocks >> (sbi->cluster_bits - 9))) {
 		fat_fs_error(sb, "clusters badly computed (%d != %llu)",
 			     new_fclus,
@@ -291,3 +290,90 @@ int fat_sync_bhs(struct buffer_head **bhs, int nr_bhs)
 	}
 	return err;
 }
+
+/*
+ * Precomputes nls_tolower() of nls_io for every byte, and checks whether
+ * it folds ASCII as usual, for fat_name_cmpi() and fat_name_hashi().
+ */
+void fat_init_name_fold(struct msdos_sb_info *sbi)
+{
+	int c;
+
+	sbi->name_fold_ascii = 1;
+	for (c = 0; c < 256; c++) {
+		sbi->name_fold[c] = nls_tolower(sbi->nls_io, c);
+		if (c < 0x80 && sbi->name_fold[c] !=
+		    ((c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c))
+			sbi->name_fold_ascii = 0;
+	}
+}
+
+/* Folds 8 ASCII bytes: 0x20 is added to the ones from 'A' to 'Z' */
+static inline u64 fat_fold_ascii8(u64 v)
+{
+	u64 upper = ((v + (0x80 - 'A') * FAT_ONES) ^
+		     (v + (0x80 - 'Z' - 1) * FAT_ONES)) & FAT_HIGHS;
+
+	return v | (upper >> 2);
+}
+
+/* Folds 8 bytes of name, as nls_tolower() does */
+static inline u64 fat_fold8(const struct msdos_sb_info *sbi,
+			    const unsigned char *name)
+{
+	u64 v = get_unaligned((const u64 *)name);
+	unsigned char buf[8];
+	int i;
+
+	if (sbi->name_fold_ascii && !(v & FAT_HIGHS))
+		return fat_fold_ascii8(v);
+	for (i = 0; i < 8; i++)
+		buf[i] = sbi->name_fold[name[i]];
+	return get_unaligned((const u64 *)buf);
+}
+
+/*
+ * Compares two names as nls_strnicmp() with nls_io does, 8 bytes at a
+ * time. Returns 0 if they match.
+ */
+int fat_name_cmpi(const struct msdos_sb_info *sbi, const unsigned char *a,
+		  const unsigned char *b, int len)
+{
+	for (; len >= 8; a += 8, b += 8, len -= 8) {
+		if (get_unaligned((const u64 *)a) ==
+		    get_unaligned((const u64 *)b))
+			continue;
+		if (fat_fold8(sbi, a) != fat_fold8(sbi, b))
+			return 1;
+	}
+	for (; len; a++, b++, len--) {
+		if (sbi->name_fold[*a] != sbi->name_fold[*b])
+			return 1;
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(fat_name_cmpi);
+
+/*
+ * Hashes a name folded as fat_name_cmpi() compares it, so that the names
+ * it matches have the same hash.
+ */
+u32 fat_name_hashi(const struct msdos_sb_info *sbi, const void *salt,
+		   const unsigned char *name, int len)
+{
+	u64 hash = (unsigned long)salt ^ len, v;
+	unsigned char buf[8];
+	int i;
+
+	for (; len >= 8; name += 8, len -= 8)
+		hash = (hash ^ fat_fold8(sbi, name)) * GOLDEN_RATIO_64;
+	if (len) {
+		memset(buf, 0, sizeof(buf));
+		for (i = 0; i < len; i++)
+			buf[i] = sbi->name_fold[name[i]];
+		v = get_unaligned((const u64 *)buf);
+		hash = (hash ^ v) * GOLDEN_RATIO_64;
+	}
+	return hash_64(hash, 32);
+}
+EXPORT_SYMBOL_GPL(fat_name_hashi);
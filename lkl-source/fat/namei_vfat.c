@@ -19,6 +19,7 @@
 #include <linux/ctype.h>
 #include <linux/slab.h>
 #include <linux/namei.h>
+#include <asm/unaligned.h>
 #include "fat.h"
 #include <linux/syscalls.h>
 
@@ -131,19 +132,8 @@ static int vfat_hash(const struct dentry *dentry, struct qstr *qstr)
  */
 static int vfat_hashi(const struct dentry *dentry, struct qstr *qstr)
 {
-	struct nls_table *t = MSDOS_SB(dentry->d_sb)->nls_io;
-	const unsigned char *name;
-	unsigned int len;
-	unsigned long hash;
-
-	name = qstr->name;
-	len = vfat_striptail_len(qstr);
-
-	hash = init_name_hash(dentry);
-	while (len--)
-		hash = partial_name_hash(nls_tolower(t, *name++), hash);
-	qstr->hash = end_name_hash(hash);
-
+	qstr->hash = fat_name_hashi(MSDOS_SB(dentry->d_sb), dentry,
+				    qstr->name, vfat_striptail_len(qstr));
 	return 0;
 }
 
@@ -153,14 +143,14 @@ static int vfat_hashi(const struct dentry *dentry, struct qstr *qstr)
 static int vfat_cmpi(const struct dentry *dentry,
 		unsigned int len, const char *str, const struct qstr *name)
 {
-	struct nls_table *t = MSDOS_SB(dentry->d_sb)->nls_io;
 	unsigned int alen, blen;
 
 	/* A filename cannot end in '.' or we treat it like it has none */
 	alen = vfat_striptail_len(name);
 	blen = __vfat_striptail_len(len, str);
 	if (alen == blen) {
-		if (nls_strnicmp(t, name->name, str, alen) == 0)
+		if (fat_name_cmpi(MSDOS_SB(dentry->d_sb), name->name, str,
+				  alen) == 0)
 			return 0;
 	}
 	return 1;
@@ -506,6 +496,37 @@ static int vfat_create_shortname(struct inode *dir, struct nls_table *nls,
 	return 0;
 }
 
+/*
+ * Widens the leading ASCII bytes of name, up to len of them, to UTF-16
+ * and returns how many there are. With escape, ':' ends them too. The
+ * bytes are checked 8 at a time.
+ */
+static int vfat_ascii_to_uni(const unsigned char *name, int len, wchar_t *op,
+			     int escape)
+{
+	u64 v, colons;
+	int n = 0, k;
+
+	while (n + 8 <= len) {
+		v = get_unaligned((const u64 *)(name + n));
+		if (v & FAT_HIGHS)
+			break;
+		if (escape) {
+			colons = v ^ (':' * FAT_ONES);
+			if ((colons - FAT_ONES) & ~colons & FAT_HIGHS)
+				break;
+		}
+		for (k = 0; k < 8; k++)
+			op[n + k] = name[n + k];
+		n += 8;
+	}
+	while (n < len && name[n] < 0x80 && !(escape && name[n] == ':')) {
+		op[n] = name[n];
+		n++;
+	}
+	return n;
+}
+
 /* Translate a string, including coded sequences into Unicode */
 static int
 xlate_to_uni(const unsigned char *name, int len, unsigned char *outname,
@@ -520,8 +541,15 @@ xlate_to_uni(const unsigned char *name, int len, unsigned char *outname,
 	int charlen;
 
 	if (utf8) {
-		*outlen = utf8s_to_utf16s(name, len, UTF16_HOST_ENDIAN,
-				(wchar_t *) outname, FAT_LFN_LEN + 2);
+		*outlen = vfat_ascii_to_uni(name, min(len, FAT_LFN_LEN + 1),
+					    (wchar_t *)outname, 0);
+		if (*outlen < len && *outlen <= FAT_LFN_LEN) {
+			k = utf8s_to_utf16s(name + *outlen, len - *outlen,
+					UTF16_HOST_ENDIAN,
+					(wchar_t *)outname + *outlen,
+					FAT_LFN_LEN + 2 - *outlen);
+			*outlen = k < 0 ? k : *outlen + k;
+		}
 		if (*outlen < 0)
 			return *outlen;
 		else if (*outlen > FAT_LFN_LEN)
@@ -532,6 +560,16 @@ xlate_to_uni(const unsigned char *name, int len, unsigned char *outname,
 		for (i = 0, ip = name, op = outname, *outlen = 0;
 			 i < len && *outlen < FAT_LFN_LEN;
 			 *outlen += 1) {
+			if (*ip < 0x80 && !(escape && *ip == ':')) {
+				k = vfat_ascii_to_uni(ip, min(len - i,
+						FAT_LFN_LEN - *outlen),
+						(wchar_t *)op, escape);
+				ip += k;
+				i += k;
+				op += k * 2;
+				*outlen += k - 1;
+				continue;
+			}
 			if (escape && (*ip == ':')) {
 				if (i > len - 5)
 					return -EINVAL;
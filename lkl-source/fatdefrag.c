@@ -0,0 +1,210 @@
+/*
+ * fatdefrag - defragments the files of a mounted FAT filesystem
+ *
+ * Usage: fatdefrag [-n] [-m min_fragments] <directory>
+ *
+ * Walks the tree under <directory>, counts the fragments of each regular
+ * file with FIBMAP, and asks the kernel to move the most fragmented ones
+ * into contiguous runs first (FAT_IOCTL_DEFRAG). The directories are
+ * defragmented last; the kernel skips those which are contiguous already.
+ *
+ * FIBMAP needs CAP_SYS_RAWIO, so this has to run as root.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+/* Must match fat/fat.h */
+#define FAT_IOCTL_DEFRAG	_IO('r', 0x14)
+
+struct defrag_file {
+	char *path;
+	long frags;
+};
+
+static struct defrag_file *files;
+static size_t nr_files, max_files;
+static char **dirs;
+static size_t nr_dirs, max_dirs;
+static long min_frags = 2;
+static int dry_run;
+
+/* Counts the runs of contiguous blocks of a file, or -1 on error */
+static long count_fragments(const char *path, const struct stat *st)
+{
+	long blocks, i, frags = 0;
+	int fd, blksz, prev = -1, block;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (ioctl(fd, FIGETBSZ, &blksz) < 0 || blksz <= 0) {
+		close(fd);
+		return -1;
+	}
+
+	blocks = (st->st_size + blksz - 1) / blksz;
+	for (i = 0; i < blocks; i++) {
+		block = i;
+		if (ioctl(fd, FIBMAP, &block) < 0) {
+			frags = -1;
+			break;
+		}
+		if (block == 0)		/* hole, FAT has none */
+			continue;
+		if (block != prev + 1)
+			frags++;
+		prev = block;
+	}
+	close(fd);
+	return frags;
+}
+
+static int add_file(const char *path, long frags)
+{
+	if (nr_files == max_files) {
+		size_t n = max_files ? max_files * 2 : 256;
+		struct defrag_file *p = realloc(files, n * sizeof(*p));
+
+		if (!p)
+			return -1;
+		files = p;
+		max_files = n;
+	}
+	files[nr_files].path = strdup(path);
+	if (!files[nr_files].path)
+		return -1;
+	files[nr_files].frags = frags;
+	nr_files++;
+	return 0;
+}
+
+static int add_dir(const char *path)
+{
+	if (nr_dirs == max_dirs) {
+		size_t n = max_dirs ? max_dirs * 2 : 64;
+		char **p = realloc(dirs, n * sizeof(*p));
+
+		if (!p)
+			return -1;
+		dirs = p;
+		max_dirs = n;
+	}
+	dirs[nr_dirs] = strdup(path);
+	if (!dirs[nr_dirs])
+		return -1;
+	nr_dirs++;
+	return 0;
+}
+
+static int visit(const char *path, const struct stat *st, int type,
+		 struct FTW *ftw)
+{
+	long frags;
+
+	if (type == FTW_D)
+		return add_dir(path) ? FTW_STOP : FTW_CONTINUE;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return FTW_CONTINUE;
+
+	frags = count_fragments(path, st);
+	if (frags < 0) {
+		fprintf(stderr, "fatdefrag: %s: %s\n", path, strerror(errno));
+		return FTW_CONTINUE;
+	}
+	if (frags >= min_frags && add_file(path, frags))
+		return FTW_STOP;
+	return FTW_CONTINUE;
+}
+
+/* Most fragmented first */
+static int cmp_frags(const void *a, const void *b)
+{
+	const struct defrag_file *fa = a, *fb = b;
+
+	if (fa->frags != fb->frags)
+		return fa->frags < fb->frags ? 1 : -1;
+	return strcmp(fa->path, fb->path);
+}
+
+static int defrag(const char *path, int flags)
+{
+	int fd, ret;
+
+	if (dry_run)
+		return 0;
+
+	fd = open(path, flags);
+	if (fd < 0)
+		return -1;
+	ret = ioctl(fd, FAT_IOCTL_DEFRAG);
+	close(fd);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: fatdefrag [-n] [-m min_fragments] <directory>\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i, done = 0, failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "nm:")) != -1) {
+		switch (opt) {
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'm':
+			min_frags = strtol(optarg, NULL, 0);
+			if (min_frags < 2)
+				min_frags = 2;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	if (nftw(argv[optind], visit, 32, FTW_PHYS | FTW_MOUNT |
+		 FTW_ACTIONRETVAL) != 0) {
+		perror("fatdefrag");
+		return 1;
+	}
+
+	qsort(files, nr_files, sizeof(*files), cmp_frags);
+	for (i = 0; i < nr_files; i++) {
+		printf("%8ld %s\n", files[i].frags, files[i].path);
+		if (defrag(files[i].path, O_RDONLY) < 0) {
+			fprintf(stderr, "fatdefrag: %s: %s\n", files[i].path,
+				strerror(errno));
+			failed++;
+		} else
+			done++;
+	}
+
+	for (i = 0; i < nr_dirs; i++) {
+		/* EINVAL is the root directory, which can't be moved */
+		if (defrag(dirs[i], O_RDONLY | O_DIRECTORY) < 0 &&
+		    errno != EINVAL) {
+			fprintf(stderr, "fatdefrag: %s: %s\n", dirs[i],
+				strerror(errno));
+			failed++;
+		}
+	}
+
+	printf("%zu files defragmented, %zu failed\n", done, failed);
+	return failed ? 1 : 0;
+}